@@ -0,0 +1,264 @@
+/*
+  Benchmark
+  
+  Measures the cost of the main EventStateMachine operations and prints
+  the results as CSV lines on the serial port, so they can be collected
+  by a script and compared across releases:
+  
+  H,platform,cpuMHz,iterations
+  R,test,param,iterations,cycles,cyclesPerOp,nsPerOp
+  M,test,cycles,freeBefore,freeAfter,maxFreeBlock,fragmentation
+  
+  Tests:
+  - setState:          A -> B transition vs. number of onEnter/onExit callbacks
+  - setStateFrozen:    the same after freeze()
+  - setStateSparse:    transitions around a ring of 16 states vs. number of
+                       states with callbacks (the others are skipped by the
+                       per-state flags without touching any list)
+  - update:            one update() vs. number of onState callbacks
+  - timeoutArmCancel:  A -> B -> A round trip vs. number of timeouts of B
+  - heap:              free heap and fragmentation after N configure/remove cycles
+  
+  Send 'b' to run the benchmark again.
+  
+  created May 8, 2025
+  by Corrado Casoni
+*/
+
+#include <EventStateMachine.h>
+
+// Define states
+enum States {
+  STATE_A,
+  STATE_B,
+  NUM_STATES
+};
+
+// Number of operations per measurement
+const uint32_t ITERATIONS = 1000;
+
+// Number of callbacks or timeouts for each measurement
+const uint8_t SIZES[] = {0, 1, 2, 4, 8, 16};
+const uint8_t NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+
+// States of the ring used by the sparse transition test
+const uint8_t RING_STATES = 16;
+
+// Number of configure/remove cycles for the heap tests
+const uint16_t HEAP_CYCLES = 100;
+
+// Empty callbacks: only the dispatch cost is measured
+void noopCallback(uint8_t current, uint8_t other) {}
+void noopFunction(uint8_t state) {}
+void noopTimeout(uint8_t current, uint8_t previous) {}
+
+uint32_t maxFreeBlock() {
+#if defined(ESP8266)
+  return ESP.getMaxFreeBlockSize();
+#else
+  return ESP.getMaxAllocHeap();
+#endif
+}
+
+void printResult(const char* test, uint8_t param, uint32_t operations, uint32_t cycles) {
+  Serial.print("R,");
+  Serial.print(test);
+  Serial.print(',');
+  Serial.print(param);
+  Serial.print(',');
+  Serial.print(operations);
+  Serial.print(',');
+  Serial.print(cycles);
+  Serial.print(',');
+  Serial.print(cycles / operations);
+  Serial.print(',');
+  Serial.println((uint32_t)((uint64_t)cycles * 1000 / ESP.getCpuFreqMHz() / operations));
+}
+
+void printHeap(const char* test, uint16_t cycles, uint32_t freeBefore) {
+  uint32_t freeAfter = ESP.getFreeHeap();
+  uint32_t maxBlock = maxFreeBlock();
+  
+  Serial.print("M,");
+  Serial.print(test);
+  Serial.print(',');
+  Serial.print(cycles);
+  Serial.print(',');
+  Serial.print(freeBefore);
+  Serial.print(',');
+  Serial.print(freeAfter);
+  Serial.print(',');
+  Serial.print(maxBlock);
+  Serial.print(',');
+  Serial.println(freeAfter > 0 ? 100 - (uint32_t)((uint64_t)maxBlock * 100 / freeAfter) : 0);
+}
+
+// A -> B -> A round trips, the result is the cost of a single transition
+void benchTransitions(uint8_t callbacks, bool frozen) {
+  EventStateMachine machine(NUM_STATES);
+  for (uint8_t s = 0; s < NUM_STATES; s++) {
+    for (uint8_t i = 0; i < callbacks; i++) {
+      machine.addOnEnter(s, noopCallback);
+      machine.addOnExit(s, noopCallback);
+    }
+  }
+  if (frozen) {
+    machine.freeze();
+  }
+  machine.setState(STATE_A);
+  
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    machine.setState(STATE_B);
+    machine.setState(STATE_A);
+  }
+  uint32_t cycles = ESP.getCycleCount() - start;
+  
+  printResult(frozen ? "setStateFrozen" : "setState", callbacks, 2 * ITERATIONS, cycles);
+}
+
+// Only the first 'configured' states of the ring have callbacks, like a protocol
+// machine where most states just wait for the next event
+void benchSparseTransitions(uint8_t configured) {
+  EventStateMachine machine(RING_STATES);
+  for (uint8_t s = 0; s < configured; s++) {
+    machine.addOnEnter(s, noopCallback);
+    machine.addOnExit(s, noopCallback);
+  }
+  machine.setState(0);
+  
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    machine.setState((i + 1) % RING_STATES);
+  }
+  uint32_t cycles = ESP.getCycleCount() - start;
+  
+  printResult("setStateSparse", configured, ITERATIONS, cycles);
+}
+
+void benchUpdate(uint8_t callbacks) {
+  EventStateMachine machine(NUM_STATES);
+  for (uint8_t i = 0; i < callbacks; i++) {
+    machine.addOnState(STATE_A, noopFunction);
+  }
+  machine.setState(STATE_A);
+  
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    machine.update();
+  }
+  uint32_t cycles = ESP.getCycleCount() - start;
+  
+  printResult("update", callbacks, ITERATIONS, cycles);
+}
+
+// Entering B arms its timeouts, leaving it cancels them
+void benchTimeouts(uint8_t timeouts) {
+  EventStateMachine machine(NUM_STATES);
+  for (uint8_t i = 0; i < timeouts; i++) {
+    // Long durations: no timeout expires during the measurement
+    machine.addTimeout(STATE_B, 3600000UL + i, noopTimeout);
+  }
+  machine.setState(STATE_A);
+  
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    machine.setState(STATE_B);
+    machine.setState(STATE_A);
+  }
+  uint32_t cycles = ESP.getCycleCount() - start;
+  
+  printResult("timeoutArmCancel", timeouts, ITERATIONS, cycles);
+}
+
+void configureAll(EventStateMachine& machine) {
+  for (uint8_t s = 0; s < NUM_STATES; s++) {
+    machine.configureState(s, 1000 + s, noopCallback, noopFunction, noopCallback, noopTimeout);
+    machine.addTransition(s, 0, (s + 1) % NUM_STATES);
+  }
+}
+
+void removeAll(EventStateMachine& machine) {
+  for (uint8_t s = 0; s < NUM_STATES; s++) {
+    machine.removeOnEnter(s, noopCallback);
+    machine.removeOnState(s, noopFunction);
+    machine.removeOnExit(s, noopCallback);
+    machine.removeTimeout(s, 1000 + s);
+    machine.removeTransition(s, 0);
+  }
+}
+
+void benchHeap() {
+  // Callbacks added and removed on a long-lived machine
+  uint32_t freeBefore = ESP.getFreeHeap();
+  EventStateMachine* machine = new EventStateMachine(NUM_STATES);
+  for (uint16_t c = 0; c < HEAP_CYCLES; c++) {
+    configureAll(*machine);
+    removeAll(*machine);
+  }
+  printHeap("heapReconfigure", HEAP_CYCLES, freeBefore);
+  delete machine;
+  
+  // Whole machines created, configured and destroyed
+  freeBefore = ESP.getFreeHeap();
+  for (uint16_t c = 0; c < HEAP_CYCLES; c++) {
+    machine = new EventStateMachine(NUM_STATES);
+    configureAll(*machine);
+    machine->setState(STATE_B);
+    delete machine;
+    yield();
+  }
+  printHeap("heapCreateDestroy", HEAP_CYCLES, freeBefore);
+}
+
+void runBenchmark() {
+  Serial.print("H,");
+#if defined(ESP8266)
+  Serial.print("ESP8266");
+#else
+  Serial.print("ESP32");
+#endif
+  Serial.print(',');
+  Serial.print(ESP.getCpuFreqMHz());
+  Serial.print(',');
+  Serial.println(ITERATIONS);
+  
+  for (uint8_t i = 0; i < NUM_SIZES; i++) {
+    benchTransitions(SIZES[i], false);
+    yield();
+  }
+  for (uint8_t i = 0; i < NUM_SIZES; i++) {
+    benchTransitions(SIZES[i], true);
+    yield();
+  }
+  for (uint8_t i = 0; i < NUM_SIZES; i++) {
+    benchSparseTransitions(SIZES[i]);
+    yield();
+  }
+  for (uint8_t i = 0; i < NUM_SIZES; i++) {
+    benchUpdate(SIZES[i]);
+    yield();
+  }
+  for (uint8_t i = 0; i < NUM_SIZES; i++) {
+    benchTimeouts(SIZES[i]);
+    yield();
+  }
+  benchHeap();
+  
+  Serial.println("END");
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  
+  runBenchmark();
+}
+
+void loop() {
+  if (Serial.available() > 0 && Serial.read() == 'b') {
+    runBenchmark();
+  }
+  
+  delay(10);
+}
@@ -0,0 +1,108 @@
+/*
+  StaticStateMachine
+
+  Example of the compile-time configured StaticEventStateMachine.
+  The callback table is a constexpr array placed in flash and the
+  machine itself never touches the heap: the state set and the
+  number of callbacks per state are fixed at build time.
+
+  The circuit:
+  - Built-in LED on pin LED_BUILTIN
+
+  created May 8, 2025
+  by Corrado Casoni
+*/
+
+#include <StaticEventStateMachine.h>
+
+// Define states
+enum States {
+  STATE_IDLE,
+  STATE_RUNNING,
+  STATE_ERROR,
+  NUM_STATES
+};
+
+// Callback functions
+void onEnterRunning(uint8_t current, uint8_t previous) {
+  Serial.println("Entering RUNNING state");
+  digitalWrite(LED_BUILTIN, HIGH);
+}
+
+void onExitRunning(uint8_t current, uint8_t next) {
+  Serial.println("Exiting RUNNING state");
+  digitalWrite(LED_BUILTIN, LOW);
+}
+
+void duringRunning(uint8_t state) {
+  static unsigned long lastBlink = 0;
+  if (millis() - lastBlink > 500) {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    lastBlink = millis();
+  }
+}
+
+void onRunningTimeout(uint8_t current, uint8_t previous);
+
+void onEnterError(uint8_t current, uint8_t previous) {
+  Serial.println("Entering ERROR state");
+}
+
+// Up to 1 callback per kind and 1 timeout per state
+typedef StaticStateDefinition<1, 1> StateDef;
+
+// State table: { onEnters, onStates, onExits, timeouts }
+constexpr StateDef stateTable[NUM_STATES] = {
+  /* STATE_IDLE    */ { {{nullptr}},        {{nullptr}},       {{nullptr}},       {{ {0, nullptr} }} },
+  /* STATE_RUNNING */ { {{onEnterRunning}}, {{duringRunning}}, {{onExitRunning}}, {{ {10000, onRunningTimeout} }} },
+  /* STATE_ERROR   */ { {{onEnterError}},   {{nullptr}},       {{nullptr}},       {{ {0, nullptr} }} }
+};
+
+// Create state machine
+StaticEventStateMachine<NUM_STATES, 1, 1> stateMachine(stateTable);
+
+void onRunningTimeout(uint8_t current, uint8_t previous) {
+  Serial.println("RUNNING state timeout");
+  stateMachine.setState(STATE_ERROR);
+}
+
+void setup() {
+  Serial.begin(115200);
+  pinMode(LED_BUILTIN, OUTPUT);
+  
+  Serial.println("EventStateMachine Static Example");
+  
+  // Set initial state
+  stateMachine.setState(STATE_IDLE);
+  
+  Serial.println("Press 'r' to enter RUNNING state");
+  Serial.println("Press 'i' to enter IDLE state");
+  Serial.println("Press 'e' to enter ERROR state");
+}
+
+void loop() {
+  // Update state machine
+  stateMachine.update();
+  
+  // Process serial commands
+  if (Serial.available() > 0) {
+    char cmd = Serial.read();
+    switch (cmd) {
+      case 'r':
+        Serial.println("Command: Enter RUNNING state");
+        stateMachine.setState(STATE_RUNNING);
+        break;
+      case 'i':
+        Serial.println("Command: Enter IDLE state");
+        stateMachine.setState(STATE_IDLE);
+        break;
+      case 'e':
+        Serial.println("Command: Enter ERROR state");
+        stateMachine.setState(STATE_ERROR);
+        break;
+    }
+  }
+  
+  // Small delay
+  delay(10);
+}
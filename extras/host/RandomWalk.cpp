@@ -0,0 +1,131 @@
+/*
+  RandomWalk.cpp - Host simulation of EventStateMachine in virtual time
+
+  Runs 24 hours of randomized transitions, events and timeouts in well
+  under a second of CPU time, checking that every timeout fires in a state
+  that is active and after its full duration. Being a plain desktop
+  program it can be run under gdb, valgrind, perf or the sanitizers.
+
+  Build and run from this directory:
+
+    g++ -std=c++14 -O2 -DESM_HOST -I../../src -o random_walk RandomWalk.cpp \
+      ../../src/EsmHost.cpp ../../src/EsmAllocator.cpp ../../src/EventStateMachine.cpp \
+      ../../src/StateTrace.cpp ../../src/EsmScheduler.cpp
+    ./random_walk [seed]
+
+  created May 8, 2025
+  by Corrado Casoni
+*/
+
+#include <EventStateMachine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Define states: HEATING and COOLING are children of RUNNING
+enum States {
+  STATE_IDLE,
+  STATE_RUNNING,
+  STATE_HEATING,
+  STATE_COOLING,
+  STATE_ERROR,
+  NUM_STATES
+};
+
+enum Events {
+  EV_START,
+  EV_STOP,
+  EV_TOGGLE,
+  EV_FAULT,
+  NUM_EVENTS
+};
+
+const unsigned long SIMULATED_MS = 24UL * 60 * 60 * 1000;
+const unsigned long RUNNING_TIMEOUT = 45000;
+const unsigned long ERROR_TIMEOUT = 5000;
+
+EventStateMachine stateMachine(NUM_STATES);
+
+unsigned long transitions = 0;
+unsigned long timeoutsFired = 0;
+unsigned long eventsPosted = 0;
+unsigned long failures = 0;
+unsigned long runningEnteredAt = 0;
+unsigned long errorEnteredAt = 0;
+
+void check(bool condition, const char* message) {
+  if (!condition) {
+    failures++;
+    printf("FAIL at %lu ms: %s\n", millis(), message);
+  }
+}
+
+void onEnterRunning(StateId state, StateId previous) {
+  runningEnteredAt = millis();
+}
+
+void onEnterError(StateId state, StateId previous) {
+  errorEnteredAt = millis();
+}
+
+// Shared timeout of RUNNING: keeps running while moving between HEATING and COOLING
+void onRunningTimeout(StateId state, StateId previous) {
+  timeoutsFired++;
+  check(stateMachine.isInState(STATE_RUNNING), "RUNNING timeout outside RUNNING");
+  check(millis() - runningEnteredAt >= RUNNING_TIMEOUT, "RUNNING timeout fired early");
+  stateMachine.setState(STATE_ERROR);
+}
+
+void onErrorTimeout(StateId state, StateId previous) {
+  timeoutsFired++;
+  check(stateMachine.getCurrentState() == STATE_ERROR, "ERROR timeout outside ERROR");
+  check(millis() - errorEnteredAt >= ERROR_TIMEOUT, "ERROR timeout fired early");
+  stateMachine.setState(STATE_IDLE);
+}
+
+void countTransition(StateId fromState, StateId toState) {
+  transitions++;
+}
+
+int main(int argc, char** argv) {
+  unsigned int seed = argc > 1 ? (unsigned int)atoi(argv[1]) : 1;
+  srand(seed);
+  
+  stateMachine.setParent(STATE_HEATING, STATE_RUNNING);
+  stateMachine.setParent(STATE_COOLING, STATE_RUNNING);
+  
+  stateMachine.addOnEnter(STATE_RUNNING, onEnterRunning);
+  stateMachine.addTimeout(STATE_RUNNING, RUNNING_TIMEOUT, onRunningTimeout);
+  stateMachine.addOnEnter(STATE_ERROR, onEnterError);
+  stateMachine.addTimeout(STATE_ERROR, ERROR_TIMEOUT, onErrorTimeout);
+  stateMachine.addAfterStateChangeHandler(countTransition);
+  
+  stateMachine.addTransition(STATE_IDLE, EV_START, STATE_HEATING);
+  stateMachine.addTransition(STATE_HEATING, EV_TOGGLE, STATE_COOLING);
+  stateMachine.addTransition(STATE_COOLING, EV_TOGGLE, STATE_HEATING);
+  stateMachine.addTransition(STATE_RUNNING, EV_STOP, STATE_IDLE);
+  stateMachine.addTransition(STATE_RUNNING, EV_FAULT, STATE_ERROR);
+  
+  clock_t start = clock();
+  
+  // One update() every 10 ms of virtual time, a random event now and then
+  while (millis() < SIMULATED_MS) {
+    if (rand() % 200 == 0) {
+      uint8_t eventId = rand() % NUM_EVENTS;
+      // Faults are rare
+      if (eventId != EV_FAULT || rand() % 20 == 0) {
+        stateMachine.postEvent(eventId);
+        eventsPosted++;
+      }
+    }
+  
+    stateMachine.update();
+    EsmHost::advance(10);
+  }
+  
+  double cpuMs = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+  
+  printf("seed,simulatedMs,cpuMs,events,transitions,timeouts,failures\n");
+  printf("%u,%lu,%.1f,%lu,%lu,%lu,%lu\n", seed, SIMULATED_MS, cpuMs, eventsPosted, transitions, timeoutsFired, failures);
+  return failures == 0 ? 0 : 1;
+}
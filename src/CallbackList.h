@@ -0,0 +1,87 @@
+/*
+  CallbackList.h - Callback storage with stable slots and O(1) removal
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_CALLBACK_LIST_H
+#define EVENT_STATE_MACHINE_CALLBACK_LIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "EsmAllocator.h"
+
+// Numero massimo di voci di una lista (l'indice entra nel CallbackHandle)
+#define ESM_MAX_LIST_SLOTS 255
+
+// Lista di callback a posizioni stabili: la rimozione libera la posizione senza
+// spostare le altre voci, un nuovo inserimento riusa la prima posizione libera.
+// Ogni voce occupata ha una generazione diversa da 0, usata per riconoscere
+// i CallbackHandle non più validi
+template <typename T>
+class CallbackList {
+public:
+  struct Slot {
+    T value;
+    uint16_t generation;       // 0 = posizione libera
+  };
+
+  explicit CallbackList(const EsmStlAllocator<Slot>& allocator = EsmStlAllocator<Slot>())
+    : slots(allocator), freeSlots(0) {}
+
+  // Indice della posizione usata, -1 se la lista è piena
+  int add(const T& value, uint16_t generation) {
+    if (freeSlots > 0) {
+      for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].generation != 0) continue;
+        slots[i].value = value;
+        slots[i].generation = generation;
+        freeSlots--;
+        return i;
+      }
+    }
+
+    if (slots.size() >= ESM_MAX_LIST_SLOTS) return -1;
+    slots.push_back({value, generation});
+    return slots.size() - 1;
+  }
+
+  // O(1): la voce viene solo marcata libera, nessuno spostamento né riallocazione
+  bool remove(size_t index, uint16_t generation) {
+    if (index >= slots.size() || generation == 0 || slots[index].generation != generation) return false;
+    slots[index].value = T();
+    slots[index].generation = 0;
+    freeSlots++;
+    return true;
+  }
+
+  // Ripristina una voce così come era, libera o occupata (usato da unfreeze())
+  void restore(const T& value, uint16_t generation) {
+    slots.push_back({value, generation});
+    if (generation == 0) freeSlots++;
+  }
+
+  // Libera la memoria della lista
+  void release() {
+    EsmVector<Slot>(slots.get_allocator()).swap(slots);
+    freeSlots = 0;
+  }
+
+  void reserve(size_t count) { slots.reserve(count); }
+
+  // Numero di posizioni, occupate e libere
+  size_t size() const { return slots.size(); }
+
+  // Numero di voci occupate
+  size_t count() const { return slots.size() - freeSlots; }
+
+  bool isActive(size_t index) const { return slots[index].generation != 0; }
+  uint16_t generationAt(size_t index) const { return slots[index].generation; }
+  const T& operator[](size_t index) const { return slots[index].value; }
+
+private:
+  EsmVector<Slot> slots;
+  size_t freeSlots;
+};
+
+#endif // EVENT_STATE_MACHINE_CALLBACK_LIST_H
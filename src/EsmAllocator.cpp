@@ -0,0 +1,128 @@
+/*
+  EsmAllocator.cpp - Pluggable memory for the EventStateMachine tables
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+#include "EsmAllocator.h"
+
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+#include <new>
+
+EsmAllocator::EsmAllocator() {
+  for (uint8_t r = 0; r < ESM_MEMORY_REGIONS; r++) {
+    usedBytes[r] = 0;
+    highWater[r] = 0;
+  }
+}
+
+void EsmAllocator::resetHighWater() {
+  for (uint8_t r = 0; r < ESM_MEMORY_REGIONS; r++) {
+    highWater[r] = usedBytes[r].load(std::memory_order_relaxed);
+  }
+}
+
+void EsmAllocator::recordAllocation(size_t size, EsmMemoryRegion region) {
+  size_t used = usedBytes[region].fetch_add(size, std::memory_order_relaxed) + size;
+  
+  // Il massimo cresce solo: riprova se un altro task lo ha appena aggiornato
+  size_t peak = highWater[region].load(std::memory_order_relaxed);
+  while (used > peak && !highWater[region].compare_exchange_weak(peak, used, std::memory_order_relaxed)) {
+  }
+}
+
+void EsmAllocator::recordDeallocation(size_t size, EsmMemoryRegion region) {
+  usedBytes[region].fetch_sub(size, std::memory_order_relaxed);
+}
+
+EsmAllocator& EsmAllocator::heap() {
+  // Costruito al primo uso: valido anche per le macchine statiche
+  static EsmHeapAllocator heapAllocator;
+  return heapAllocator;
+}
+
+void* EsmHeapAllocator::allocate(size_t size, EsmMemoryRegion region) {
+  void* pointer = ::operator new(size);
+  if (pointer != nullptr) recordAllocation(size, region);
+  return pointer;
+}
+
+void EsmHeapAllocator::deallocate(void* pointer, size_t size, EsmMemoryRegion region) {
+  if (pointer == nullptr) return;
+  recordDeallocation(size, region);
+  ::operator delete(pointer);
+}
+
+// Ogni blocco dell'arena è allineato come un'allocazione dell'heap
+static size_t alignArena(size_t size) {
+  const size_t alignment = alignof(std::max_align_t);
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+EsmArena::EsmArena(void* buffer, size_t size, EsmAllocator* fallback)
+  : top(0), peak(0), fallbackBytes(0), fallback(fallback) {
+  // Il buffer viene ristretto alla parte allineata
+  uintptr_t start = (uintptr_t)buffer;
+  uintptr_t aligned = (uintptr_t)alignArena(start);
+  base = (uint8_t*)aligned;
+  capacity = size > aligned - start ? (size - (aligned - start)) & ~(alignof(std::max_align_t) - 1) : 0;
+}
+
+void* EsmArena::allocate(size_t size, EsmMemoryRegion region) {
+  size_t blockSize = alignArena(size);
+  if (blockSize <= capacity - top) {
+    void* pointer = base + top;
+    top += blockSize;
+    if (top > peak) peak = top;
+    recordAllocation(size, region);
+    return pointer;
+  }
+  
+  if (fallback == nullptr) return nullptr;
+  void* pointer = fallback->allocate(size, region);
+  if (pointer != nullptr) {
+    fallbackBytes += size;
+    recordAllocation(size, region);
+  }
+  return pointer;
+}
+
+void EsmArena::deallocate(void* pointer, size_t size, EsmMemoryRegion region) {
+  if (pointer == nullptr) return;
+  recordDeallocation(size, region);
+  
+  uint8_t* block = (uint8_t*)pointer;
+  if (block < base || block >= base + capacity) {
+    fallbackBytes -= size;
+    fallback->deallocate(pointer, size, region);
+    return;
+  }
+  
+  // Solo l'ultimo blocco torna disponibile; gli altri restano buchi inutilizzati
+  if (block + alignArena(size) == base + top) {
+    top = block - base;
+  }
+}
+
+#if defined(ESP32) && !defined(ESM_HOST)
+EsmCapsAllocator::EsmCapsAllocator(uint32_t configCaps, uint32_t dispatchCaps) {
+  caps[ESM_MEMORY_CONFIG] = configCaps;
+  caps[ESM_MEMORY_DISPATCH] = dispatchCaps;
+}
+
+void* EsmCapsAllocator::allocate(size_t size, EsmMemoryRegion region) {
+  void* pointer = heap_caps_malloc(size, caps[region]);
+  if (pointer == nullptr) {
+    pointer = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if (pointer != nullptr) recordAllocation(size, region);
+  return pointer;
+}
+
+void EsmCapsAllocator::deallocate(void* pointer, size_t size, EsmMemoryRegion region) {
+  if (pointer == nullptr) return;
+  recordDeallocation(size, region);
+  heap_caps_free(pointer);
+}
+#endif
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
@@ -0,0 +1,148 @@
+/*
+  EsmAllocator.h - Pluggable memory for the EventStateMachine tables
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_ALLOCATOR_H
+#define EVENT_STATE_MACHINE_ALLOCATOR_H
+
+#include "EsmPlatform.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+#include <cstddef>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+
+// Area di memoria di una richiesta: la configurazione (definizioni degli stati,
+// liste dei callback e delle transizioni) oppure i dati letti ad ogni dispatch
+// (tabella degli stati, coda dei timeout, tabella congelata, handler globali)
+enum EsmMemoryRegion : uint8_t {
+  ESM_MEMORY_CONFIG = 0,
+  ESM_MEMORY_DISPATCH,
+  ESM_MEMORY_REGIONS
+};
+
+// Sorgente della memoria di una macchina a stati. Tiene il conto, per ogni area,
+// dei byte in uso e del massimo raggiunto (high-water)
+class EsmAllocator {
+public:
+  virtual ~EsmAllocator() {}
+  
+  virtual void* allocate(size_t size, EsmMemoryRegion region) = 0;
+  virtual void deallocate(void* pointer, size_t size, EsmMemoryRegion region) = 0;
+  
+  size_t getUsedBytes(EsmMemoryRegion region) const { return usedBytes[region].load(std::memory_order_relaxed); }
+  size_t getHighWater(EsmMemoryRegion region) const { return highWater[region].load(std::memory_order_relaxed); }
+  void resetHighWater();
+  
+  // Heap globale, usato dalle macchine create senza allocatore
+  static EsmAllocator& heap();
+  
+protected:
+  EsmAllocator();
+  
+  void recordAllocation(size_t size, EsmMemoryRegion region);
+  void recordDeallocation(size_t size, EsmMemoryRegion region);
+  
+private:
+  std::atomic<size_t> usedBytes[ESM_MEMORY_REGIONS];
+  std::atomic<size_t> highWater[ESM_MEMORY_REGIONS];
+};
+
+// Heap globale (operator new): lo stesso comportamento delle versioni precedenti
+class EsmHeapAllocator : public EsmAllocator {
+public:
+  void* allocate(size_t size, EsmMemoryRegion region) override;
+  void deallocate(void* pointer, size_t size, EsmMemoryRegion region) override;
+};
+
+// Arena su un buffer fornito dal chiamante: allocazione a incremento, la memoria
+// liberata viene recuperata solo se è l'ultimo blocco. Quando il buffer è pieno
+// le richieste passano all'allocatore di riserva. Senza riserva (nullptr) le
+// richieste che non entrano restituiscono nullptr: la macchina rifiuta la
+// configurazione, ma la crescita delle liste termina il programma, quindi il
+// buffer va dimensionato con getArenaPeak(). Non è thread-safe: le macchine
+// che condividono un'arena vanno configurate dallo stesso task
+class EsmArena : public EsmAllocator {
+public:
+  EsmArena(void* buffer, size_t size, EsmAllocator* fallback = &EsmAllocator::heap());
+  
+  void* allocate(size_t size, EsmMemoryRegion region) override;
+  void deallocate(void* pointer, size_t size, EsmMemoryRegion region) override;
+  
+  size_t getCapacity() const { return capacity; }
+  size_t getArenaUsed() const { return top; }               // Byte del buffer occupati, buchi compresi
+  size_t getArenaPeak() const { return peak; }              // Dimensione minima del buffer per questo carico
+  size_t getFallbackBytes() const { return fallbackBytes; } // Byte in uso presso l'allocatore di riserva
+  
+private:
+  uint8_t* base;
+  size_t capacity;
+  size_t top;
+  size_t peak;
+  size_t fallbackBytes;
+  EsmAllocator* fallback;
+};
+
+#if defined(ESP32) && !defined(ESM_HOST)
+#include <esp_heap_caps.h>
+
+// Heap dell'ESP32 con capability diverse per area, ad esempio configurazione in
+// PSRAM e dati di dispatch in DRAM interna. Se un'area non ha memoria (board senza
+// PSRAM) la richiesta ripiega sull'heap interno
+class EsmCapsAllocator : public EsmAllocator {
+public:
+  EsmCapsAllocator(uint32_t configCaps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+                   uint32_t dispatchCaps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  
+  void* allocate(size_t size, EsmMemoryRegion region) override;
+  void deallocate(void* pointer, size_t size, EsmMemoryRegion region) override;
+  
+private:
+  uint32_t caps[ESM_MEMORY_REGIONS];
+};
+#endif
+
+// Adattatore per i contenitori della libreria: conserva l'allocatore e l'area.
+// Si propaga con assegnazioni e swap, così un vector vuoto può sostituirne uno
+template <typename T>
+class EsmStlAllocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  
+  EsmStlAllocator() : allocator(&EsmAllocator::heap()), region(ESM_MEMORY_CONFIG) {}
+  EsmStlAllocator(EsmAllocator* allocator, EsmMemoryRegion region) : allocator(allocator), region(region) {}
+  
+  template <typename U>
+  EsmStlAllocator(const EsmStlAllocator<U>& other) : allocator(other.allocator), region(other.region) {}
+  
+  // I contenitori non gestiscono un nullptr: come l'operator new senza eccezioni,
+  // la memoria esaurita termina il programma invece di scrivere all'indirizzo 0
+  T* allocate(size_t count) {
+    T* pointer = static_cast<T*>(allocator->allocate(count * sizeof(T), region));
+    if (pointer == nullptr) abort();
+    return pointer;
+  }
+  void deallocate(T* pointer, size_t count) { allocator->deallocate(pointer, count * sizeof(T), region); }
+  
+  template <typename U>
+  bool operator==(const EsmStlAllocator<U>& other) const { return allocator == other.allocator && region == other.region; }
+  template <typename U>
+  bool operator!=(const EsmStlAllocator<U>& other) const { return !(*this == other); }
+  
+  EsmAllocator* allocator;
+  EsmMemoryRegion region;
+};
+
+template <typename T>
+using EsmVector = std::vector<T, EsmStlAllocator<T>>;
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // EVENT_STATE_MACHINE_ALLOCATOR_H
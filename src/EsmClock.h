@@ -0,0 +1,121 @@
+/*
+  EsmClock.h - 64-bit monotonic time base of EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_CLOCK_H
+#define EVENT_STATE_MACHINE_CLOCK_H
+
+#include "EsmPlatform.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+#if defined(ESP32) && !defined(ESM_HOST)
+#include <esp_timer.h>
+#endif
+
+// Sorgenti dell'orologio
+#define ESM_CLOCK_MICROS 0      // micros() (esp_timer sull'ESP32), 1 tick = 1 us
+#define ESM_CLOCK_CYCLES 1      // Contatore di cicli della CPU, 1 tick = 1 ciclo
+
+// Orologio di istanti di ingresso, timeout, onState con intervallo e profiler.
+// Indipendente da ESM_PROFILING_CYCLES, che cambia solo la sorgente del profiler
+#ifndef ESM_CLOCK
+#define ESM_CLOCK ESM_CLOCK_MICROS
+#endif
+
+// Sull'ESP32 il contatore di cicli è per core, mentre l'orologio viene letto sia
+// da update() sia dal task di esp_timer (timeout diretti, core 0): l'estensione a
+// 64 bit mescolerebbe i due contatori. esp_timer_get_time() è già a 64 bit
+#if ESM_CLOCK == ESM_CLOCK_CYCLES && defined(ESP32) && !defined(ESM_HOST)
+#error "ESM_CLOCK_CYCLES is not supported on ESP32: use ESM_CLOCK_MICROS (esp_timer, 64-bit)"
+#endif
+
+// Tick per microsecondo. Con i cicli vale la frequenza della CPU alla compilazione:
+// dopo un setCpuFrequencyMhz() va definito a mano. Sull'host i cicli sono simulati
+#ifndef ESM_CLOCK_TICKS_PER_US
+#if ESM_CLOCK == ESM_CLOCK_CYCLES && defined(F_CPU)
+#define ESM_CLOCK_TICKS_PER_US (F_CPU / 1000000UL)
+#elif ESM_CLOCK == ESM_CLOCK_CYCLES
+#define ESM_CLOCK_TICKS_PER_US 160
+#else
+#define ESM_CLOCK_TICKS_PER_US 1
+#endif
+#endif
+
+#define ESM_CLOCK_TICKS_PER_MS ((uint64_t)ESM_CLOCK_TICKS_PER_US * 1000)
+
+// Istante in tick dell'orologio: a 64 bit non va mai in rollover
+typedef uint64_t EsmTime;
+
+// Legge l'orologio. micros() dell'ESP8266 (micros64()) ed esp_timer dell'ESP32 sono
+// già a 64 bit. Il contatore di cicli (solo ESP8266) è a 32 bit e fa un giro in
+// pochi secondi: viene esteso contando i giri, quindi va letto almeno una volta
+// ogni mezzo giro. Per questo Ticker e sospensioni non attendono mai più di
+// ESM_CLOCK_MAX_DELAY_MS. Il contatore si ferma durante il light sleep
+inline EsmTime esmClock() {
+#if defined(ESM_HOST)
+  // micros() dell'host è già a 64 bit
+  return (EsmTime)micros() * ESM_CLOCK_TICKS_PER_US;
+#elif ESM_CLOCK == ESM_CLOCK_MICROS && defined(ESP32)
+  return (EsmTime)esp_timer_get_time();
+#elif ESM_CLOCK == ESM_CLOCK_MICROS
+  return (EsmTime)micros64();
+#else
+  // ESP8266: un solo core, basta mascherare gli interrupt (Ticker, ISR)
+  static uint32_t last = 0;
+  static uint32_t wraps = 0;
+  uint32_t savedLevel = xt_rsil(15);
+  uint32_t raw = ESP.getCycleCount();
+  if (raw < last) wraps++;
+  last = raw;
+  EsmTime now = ((EsmTime)wraps << 32) | raw;
+  xt_wsr_ps(savedLevel);
+  return now;
+#endif
+}
+
+inline EsmTime esmMillisToTicks(unsigned long ms) {
+  return (EsmTime)ms * ESM_CLOCK_TICKS_PER_MS;
+}
+
+inline uint64_t esmTicksToMicros(EsmTime ticks) {
+  return ticks / ESM_CLOCK_TICKS_PER_US;
+}
+
+inline uint64_t esmTicksToMillis(EsmTime ticks) {
+  return ticks / ESM_CLOCK_TICKS_PER_MS;
+}
+
+// Millisecondi da attendere perché trascorrano almeno 'ticks' (arrotondati per
+// eccesso: un Ticker non scatta mai prima della scadenza)
+inline unsigned long esmTicksToDelay(EsmTime ticks) {
+  uint64_t ms = (ticks + ESM_CLOCK_TICKS_PER_MS - 1) / ESM_CLOCK_TICKS_PER_MS;
+  return ms < (unsigned long)-1 ? (unsigned long)ms : (unsigned long)-2;
+}
+
+// Attesa massima di un Ticker o di una sospensione. Con i cicli è mezzo giro del
+// contatore (13 s a 160 MHz): un'attesa più lunga viene spezzata, chi si risveglia
+// rilegge l'orologio e riarma sulla scadenza vera
+#ifndef ESM_CLOCK_MAX_DELAY_MS
+#if ESM_CLOCK == ESM_CLOCK_CYCLES
+#define ESM_CLOCK_MAX_DELAY_MS ((unsigned long)(0x80000000ULL / ESM_CLOCK_TICKS_PER_MS))
+#else
+#define ESM_CLOCK_MAX_DELAY_MS ((unsigned long)-2)
+#endif
+#endif
+
+// Come esmTicksToDelay(), limitata a ESM_CLOCK_MAX_DELAY_MS: da usare per armare
+// un Ticker o per dormire
+inline unsigned long esmTicksToWait(EsmTime ticks) {
+  unsigned long ms = esmTicksToDelay(ticks);
+  return ms < ESM_CLOCK_MAX_DELAY_MS ? ms : ESM_CLOCK_MAX_DELAY_MS;
+}
+
+// Millisecondi dall'avvio letti dall'orologio della libreria
+inline uint64_t esmMillis() {
+  return esmTicksToMillis(esmClock());
+}
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // EVENT_STATE_MACHINE_CLOCK_H
@@ -0,0 +1,117 @@
+/*
+  EsmDelegate.h - Fixed-size callbacks with context, without heap allocation
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_DELEGATE_H
+#define EVENT_STATE_MACHINE_DELEGATE_H
+
+#include <cstddef>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+// Spazio interno di un EsmDelegate: basta per un metodo con il suo oggetto
+// (puntatore a membro + puntatore) o per una lambda con tre catture da 4 byte
+#ifndef ESM_DELEGATE_SIZE
+#define ESM_DELEGATE_SIZE (3 * sizeof(void*))
+#endif
+
+// Allineamento dello spazio interno: quello di un puntatore, per non allungare
+// ogni delegate. Le catture a 64 bit (uint64_t, double) richiedono alignof(uint64_t)
+#ifndef ESM_DELEGATE_ALIGN
+#define ESM_DELEGATE_ALIGN alignof(void*)
+#endif
+
+template <typename Signature>
+class EsmDelegate;
+
+// Callback a dimensione fissa: una funzione, un metodo legato a un oggetto o una
+// lambda con catture, copiati nello spazio interno. Nessuna allocazione, la
+// chiamata è una chiamata indiretta alla funzione di invocazione del tipo salvato.
+// Sono ammessi solo oggetti banalmente copiabili (puntatori, numeri, riferimenti)
+template <typename R, typename... Args>
+class EsmDelegate<R(Args...)> {
+public:
+  typedef R (*Function)(Args...);
+  
+  EsmDelegate() : invoker(nullptr) {
+    memset(storage, 0, sizeof(storage));
+  }
+  
+  EsmDelegate(std::nullptr_t) : EsmDelegate() {}
+  
+  // Funzione libera: conversione implicita, il codice esistente resta invariato
+  EsmDelegate(Function function) : EsmDelegate() {
+    if (function != nullptr) {
+      store(function);
+    }
+  }
+  
+  // Lambda o altro oggetto chiamabile
+  template <typename C, typename std::enable_if<!std::is_same<typename std::decay<C>::type, EsmDelegate>::value, int>::type = 0>
+  EsmDelegate(const C& callable) : EsmDelegate() {
+    store(callable);
+  }
+  
+  // Metodo legato a un oggetto, ad esempio EsmDelegate<...>::bind(&motor, &Motor::onEnter)
+  template <typename T>
+  static EsmDelegate bind(T* object, R (T::*method)(Args...)) {
+    return EsmDelegate(MemberCall<T, R (T::*)(Args...)>{object, method});
+  }
+  
+  template <typename T>
+  static EsmDelegate bind(const T* object, R (T::*method)(Args...) const) {
+    return EsmDelegate(MemberCall<const T, R (T::*)(Args...) const>{object, method});
+  }
+  
+  R operator()(Args... args) const {
+    return invoker(storage, args...);
+  }
+  
+  explicit operator bool() const { return invoker != nullptr; }
+  bool operator==(std::nullptr_t) const { return invoker == nullptr; }
+  bool operator!=(std::nullptr_t) const { return invoker != nullptr; }
+  
+  // Due delegate sono uguali se contengono lo stesso tipo con gli stessi byte
+  // (stessa funzione, stesso metodo sullo stesso oggetto, stesse catture). I byte
+  // dopo l'oggetto salvato sono sempre azzerati, ma il padding interno di una lambda
+  // (ad esempio un uint8_t seguito da un puntatore) non è definito: due lambda con
+  // catture uguali possono risultare diverse. Per rimuoverle va usato l'handle
+  bool operator==(const EsmDelegate& other) const {
+    return invoker == other.invoker && memcmp(storage, other.storage, sizeof(storage)) == 0;
+  }
+  bool operator!=(const EsmDelegate& other) const { return !(*this == other); }
+
+private:
+  typedef R (*Invoker)(const void* storage, Args... args);
+  
+  template <typename T, typename Method>
+  struct MemberCall {
+    T* object;
+    Method method;
+  
+    R operator()(Args... args) const { return (object->*method)(args...); }
+  };
+  
+  template <typename C>
+  static R invoke(const void* callable, Args... args) {
+    return (*static_cast<const C*>(callable))(args...);
+  }
+  
+  template <typename C>
+  void store(const C& callable) {
+    static_assert(sizeof(C) <= sizeof(storage), "Callable too large for EsmDelegate: increase ESM_DELEGATE_SIZE");
+    static_assert(alignof(C) <= ESM_DELEGATE_ALIGN, "Callable alignment too large for EsmDelegate: increase ESM_DELEGATE_ALIGN");
+    static_assert(std::is_trivially_copyable<C>::value && std::is_trivially_destructible<C>::value,
+                  "EsmDelegate only stores trivially copyable callables (capture pointers or values)");
+    new (storage) C(callable);
+    invoker = &invoke<C>;
+  }
+  
+  alignas(ESM_DELEGATE_ALIGN) unsigned char storage[ESM_DELEGATE_SIZE];
+  Invoker invoker;
+};
+
+#endif // EVENT_STATE_MACHINE_DELEGATE_H
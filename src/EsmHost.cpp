@@ -0,0 +1,226 @@
+/*
+  EsmHost.cpp - Host (desktop) backend of the EventStateMachine platform layer
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+#include "EsmHost.h"
+
+#if defined(ESM_HOST)
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+
+// Tempo dell'host in microsecondi
+static uint64_t hostTime = 0;
+static bool realTime = false;
+static uint64_t tickerSequence = 0;
+
+// Ticker esistenti, allocati una sola volta e mai distrutti: restano validi
+// anche per i Ticker statici distrutti dopo questo modulo
+static std::vector<Ticker*>& tickers() {
+  static std::vector<Ticker*>* registry = new std::vector<Ticker*>();
+  return *registry;
+}
+
+static uint64_t systemMicros() {
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t nowMicros() {
+  if (realTime) {
+    hostTime = systemMicros();
+  }
+  return hostTime;
+}
+
+unsigned long millis() {
+  return nowMicros() / 1000;
+}
+
+unsigned long micros() {
+  return nowMicros();
+}
+
+void delay(unsigned long ms) {
+  if (!realTime) {
+    EsmHost::advance(ms);
+    return;
+  }
+  
+  uint64_t until = systemMicros() + (uint64_t)ms * 1000;
+  while (systemMicros() < until) {
+    EsmHost::runTimers();
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  EsmHost::runTimers();
+}
+
+void yield() {
+  if (realTime) {
+    EsmHost::runTimers();
+  }
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t written = 0;
+  while (size--) {
+    written += write(*buffer++);
+  }
+  return written;
+}
+
+size_t Print::print(const char* str) {
+  return write((const uint8_t*)str, strlen(str));
+}
+
+size_t Print::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char value) {
+  return print((unsigned long long)value);
+}
+
+size_t Print::print(int value) {
+  return print((long long)value);
+}
+
+size_t Print::print(unsigned int value) {
+  return print((unsigned long long)value);
+}
+
+size_t Print::print(long value) {
+  return print((long long)value);
+}
+
+size_t Print::print(unsigned long value) {
+  return print((unsigned long long)value);
+}
+
+size_t Print::print(long long value) {
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), "%lld", value);
+  return print(buffer);
+}
+
+size_t Print::print(unsigned long long value) {
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), "%llu", value);
+  return print(buffer);
+}
+
+size_t Print::print(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.2f", value);
+  return print(buffer);
+}
+
+size_t Print::println() {
+  return write((const uint8_t*)"\r\n", 2);
+}
+
+size_t HostSerial::write(uint8_t c) {
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+size_t HostSerial::write(const uint8_t* buffer, size_t size) {
+  return fwrite(buffer, 1, size, stdout);
+}
+
+Ticker::Ticker() : armed(false), deadline(0), sequence(0), trampoline(nullptr), callback(nullptr), arg(0) {
+  tickers().push_back(this);
+}
+
+Ticker::~Ticker() {
+  auto& registry = tickers();
+  registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+}
+
+void Ticker::arm(uint32_t ms, Trampoline trampolineFunction, void (*callbackFunction)(), uintptr_t value) {
+  deadline = nowMicros() + (uint64_t)ms * 1000;
+  sequence = tickerSequence++;
+  trampoline = trampolineFunction;
+  callback = callbackFunction;
+  arg = value;
+  armed = true;
+}
+
+void Ticker::detach() {
+  armed = false;
+}
+
+// Esegue il Ticker con la scadenza più vicina entro 'until', portando il tempo
+// virtuale alla sua scadenza. false se non ce ne sono
+bool esmHostRunNextTimer(uint64_t until) {
+  Ticker* next = nullptr;
+  for (Ticker* ticker : tickers()) {
+    if (!ticker->armed || ticker->deadline > until) continue;
+    if (next == nullptr || ticker->deadline < next->deadline ||
+        (ticker->deadline == next->deadline && ticker->sequence < next->sequence)) {
+      next = ticker;
+    }
+  }
+  if (next == nullptr) return false;
+  
+  // Un Ticker once_ms si disarma prima del callback, che può riarmarlo
+  next->armed = false;
+  if (!realTime && next->deadline > hostTime) {
+    hostTime = next->deadline;
+  }
+  next->trampoline(next->callback, next->arg);
+  return true;
+}
+
+namespace EsmHost {
+  void advance(unsigned long ms) {
+    advanceMicros((uint64_t)ms * 1000);
+  }
+  
+  void advanceMicros(uint64_t us) {
+    if (realTime) {
+      runTimers();
+      return;
+    }
+  
+    uint64_t until = hostTime + us;
+    while (esmHostRunNextTimer(until)) {
+    }
+    hostTime = until;
+  }
+  
+  void setTime(unsigned long ms) {
+    if (!realTime) {
+      hostTime = (uint64_t)ms * 1000;
+    }
+  }
+  
+  void setRealTime(bool enable) {
+    realTime = enable;
+    hostTime = systemMicros();
+  }
+  
+  bool isRealTime() {
+    return realTime;
+  }
+  
+  void runTimers() {
+    uint64_t now = nowMicros();
+    while (esmHostRunNextTimer(now)) {
+    }
+  }
+  
+  size_t activeTimers() {
+    size_t count = 0;
+    for (Ticker* ticker : tickers()) {
+      if (ticker->active()) count++;
+    }
+    return count;
+  }
+}
+
+#endif // defined(ESM_HOST)
@@ -0,0 +1,130 @@
+/*
+  EsmHost.h - Host (desktop) backend of the EventStateMachine platform layer
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_HOST_H
+#define EVENT_STATE_MACHINE_HOST_H
+
+#if defined(ESM_HOST)
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Il tempo dell'host parte da 0 e avanza solo con EsmHost::advance() (tempo
+// virtuale, default) oppure segue l'orologio di sistema con EsmHost::setRealTime().
+// millis() e micros() restituiscono unsigned long: sull'host sono a 64 bit e non
+// vanno in rollover, usa EsmHost::setTime() per partire da un istante qualsiasi.
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// Sull'host non c'è una memoria flash separata: PROGMEM non ha effetto
+#define PROGMEM
+inline void* memcpy_P(void* dest, const void* src, size_t size) { return memcpy(dest, src, size); }
+
+// Sottoinsieme di Print del core Arduino usato dalla libreria
+class Print {
+public:
+  virtual ~Print() {}
+  
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size);
+  
+  size_t print(const char* str);
+  size_t print(char c);
+  size_t print(unsigned char value);
+  size_t print(int value);
+  size_t print(unsigned int value);
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(long long value);
+  size_t print(unsigned long long value);
+  size_t print(double value);
+  
+  size_t println();
+  
+  template <typename T>
+  size_t println(T value) {
+    size_t written = print(value);
+    return written + println();
+  }
+};
+
+// Uscita standard: Serial scrive su stdout
+class HostSerial : public Print {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  int available() { return 0; }
+  int read() { return -1; }
+  
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+};
+
+extern HostSerial Serial;
+
+// Ticker dell'host: le scadenze vengono eseguite da EsmHost::advance() o
+// EsmHost::runTimers(), sempre nel thread chiamante e in ordine di scadenza
+class Ticker {
+public:
+  Ticker();
+  ~Ticker();
+  
+  template <typename TArg>
+  void once_ms(uint32_t ms, void (*callback)(TArg), TArg arg) {
+    static_assert(sizeof(TArg) <= sizeof(uintptr_t), "Ticker argument must fit in a pointer");
+    uintptr_t value = 0;
+    memcpy(&value, &arg, sizeof(TArg));
+    arm(ms, &invoke<TArg>, reinterpret_cast<void (*)()>(callback), value);
+  }
+  
+  void detach();
+  bool active() const { return armed; }
+
+private:
+  typedef void (*Trampoline)(void (*callback)(), uintptr_t arg);
+  
+  template <typename TArg>
+  static void invoke(void (*callback)(), uintptr_t value) {
+    TArg arg;
+    memcpy(&arg, &value, sizeof(TArg));
+    reinterpret_cast<void (*)(TArg)>(callback)(arg);
+  }
+  
+  void arm(uint32_t ms, Trampoline trampoline, void (*callback)(), uintptr_t arg);
+  
+  bool armed;
+  uint64_t deadline;           // Scadenza in microsecondi del tempo dell'host
+  uint64_t sequence;           // Ordine di armo, a parità di scadenza
+  Trampoline trampoline;
+  void (*callback)();
+  uintptr_t arg;
+  
+  friend bool esmHostRunNextTimer(uint64_t until);
+};
+
+namespace EsmHost {
+  // Avanza il tempo virtuale eseguendo, nell'ordine, tutti i Ticker che scadono
+  void advance(unsigned long ms);
+  void advanceMicros(uint64_t us);
+  
+  // Imposta il tempo virtuale senza eseguire i Ticker
+  void setTime(unsigned long ms);
+  
+  // Tempo reale (orologio monotono del sistema): i Ticker scaduti vengono
+  // eseguiti da runTimers(), yield() e delay()
+  void setRealTime(bool enable);
+  bool isRealTime();
+  void runTimers();
+  
+  // Numero di Ticker armati
+  size_t activeTimers();
+}
+
+#endif // defined(ESM_HOST)
+
+#endif // EVENT_STATE_MACHINE_HOST_H
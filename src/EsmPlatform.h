@@ -0,0 +1,41 @@
+/*
+  EsmPlatform.h - Platform abstraction for EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_PLATFORM_H
+#define EVENT_STATE_MACHINE_PLATFORM_H
+
+// La libreria usa solo questi servizi della piattaforma:
+// - orologio: millis() e micros()
+// - timer:    Ticker con once_ms(ms, callback, arg) e detach()
+// - log:      Print (Serial come uscita di default del trace)
+//
+// Sulle board sono quelli del core Arduino; con ESM_HOST definito vengono da
+// EsmHost.h, che permette di compilare la libreria su Linux con un tempo virtuale.
+
+#if defined(ESM_HOST)
+#include "EsmHost.h"
+#else
+#include <Arduino.h>
+#if defined(ESP8266) || defined(ESP32)
+#include <Ticker.h>
+#endif
+#endif
+
+// Tipo degli identificativi di stato: uint8_t (default, fino a 255 stati) oppure
+// uint16_t per le macchine più grandi. È anche il tipo degli stati nelle firme dei callback
+#ifndef ESM_STATE_ID_TYPE
+#define ESM_STATE_ID_TYPE uint8_t
+#endif
+typedef ESM_STATE_ID_TYPE StateId;
+
+// Log persistente delle transizioni: richiede il file system della board
+#if (defined(ESP8266) || defined(ESP32)) && !defined(ESM_HOST)
+#define ESM_HAS_FS 1
+#else
+#define ESM_HAS_FS 0
+#endif
+
+#endif // EVENT_STATE_MACHINE_PLATFORM_H
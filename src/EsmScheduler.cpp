@@ -0,0 +1,245 @@
+/*
+  EsmScheduler.cpp - Executor driving many EventStateMachine instances
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+#include "EsmScheduler.h"
+
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+static const uint16_t NOT_IN_WHEEL = ESM_SCHEDULER_WHEEL_SLOTS;
+
+EsmScheduler::EsmScheduler() : machineCount(0), wheelTime(0), dispatching(nullptr) {
+  for (uint8_t w = 0; w < READY_WORDS; w++) {
+    ready[w] = 0;
+  }
+  for (uint16_t slot = 0; slot < ESM_SCHEDULER_WHEEL_SLOTS; slot++) {
+    wheel[slot] = NO_MACHINE;
+  }
+  for (uint8_t i = 0; i < ESM_SCHEDULER_MAX_MACHINES; i++) {
+    machines[i] = nullptr;
+    wheelSlot[i] = NOT_IN_WHEEL;
+  }
+#if defined(ESP32) && !defined(ESM_HOST)
+  task = nullptr;
+#endif
+}
+
+EsmScheduler::~EsmScheduler() {
+  for (uint8_t i = 0; i < ESM_SCHEDULER_MAX_MACHINES; i++) {
+    if (machines[i] != nullptr) remove(*machines[i]);
+  }
+}
+
+bool EsmScheduler::add(EventStateMachine& machine) {
+  if (machine.scheduler != nullptr) return false;
+  
+  uint8_t index = 0;
+  while (index < ESM_SCHEDULER_MAX_MACHINES && machines[index] != nullptr) index++;
+  if (index == ESM_SCHEDULER_MAX_MACHINES) return false;
+  
+  // Da qui in poi i timeout della macchina passano dalla ruota, non dal suo Ticker
+  machine.detachTimeoutTicker();
+  machine.scheduler = this;
+  machine.schedulerIndex = index;
+  machines[index] = &machine;
+  machineCount++;
+  
+#if ESM_THREAD_SAFE && defined(ESP32) && !defined(ESM_HOST)
+  if (task != nullptr) machine.setOwnerTask(task);
+#endif
+  
+  // Il primo passaggio calcola la sveglia
+  wake(machine);
+  return true;
+}
+
+bool EsmScheduler::remove(EventStateMachine& machine) {
+  if (machine.scheduler != this) return false;
+  
+  uint8_t index = machine.schedulerIndex;
+  wheelRemove(index);
+  ready[index / 32].fetch_and(~(1UL << (index % 32)), std::memory_order_acq_rel);
+  machines[index] = nullptr;
+  machineCount--;
+  
+  // La macchina torna al proprio Ticker; il prossimo update() ne diventa il proprietario
+  machine.scheduler = nullptr;
+#if ESM_THREAD_SAFE && defined(ESP32) && !defined(ESM_HOST)
+  machine.ownerTask = nullptr;
+#endif
+  machine.armTimeoutTicker();
+  return true;
+}
+
+void EsmScheduler::markReady(uint8_t index) {
+  ready[index / 32].fetch_or(1UL << (index % 32), std::memory_order_acq_rel);
+}
+
+void EsmScheduler::wake(const EventStateMachine& machine) {
+  if (machine.scheduler != this) return;
+  markReady(machine.schedulerIndex);
+  
+#if defined(ESP32) && !defined(ESM_HOST)
+  if (task == nullptr) return;
+  if (xPortInIsrContext()) {
+    BaseType_t higherPriorityWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(task, &higherPriorityWoken);
+    if (higherPriorityWoken) portYIELD_FROM_ISR();
+  } else {
+    xTaskNotifyGive(task);
+  }
+#endif
+}
+
+void EsmScheduler::notify(const EventStateMachine& machine) {
+  // Durante il passaggio della macchina reschedule() vede già ogni modifica
+  if (&machine == dispatching) return;
+  wake(machine);
+}
+
+void EsmScheduler::wheelInsert(uint8_t index, unsigned long wakeup) {
+  uint16_t slot = wakeup & (ESM_SCHEDULER_WHEEL_SLOTS - 1);
+  if (wheelSlot[index] == slot && wakeupAt[index] == wakeup) return;
+  
+  wheelRemove(index);
+  wakeupAt[index] = wakeup;
+  wheelSlot[index] = slot;
+  wheelPrev[index] = NO_MACHINE;
+  wheelNext[index] = wheel[slot];
+  if (wheel[slot] != NO_MACHINE) wheelPrev[wheel[slot]] = index;
+  wheel[slot] = index;
+}
+
+void EsmScheduler::wheelRemove(uint8_t index) {
+  uint16_t slot = wheelSlot[index];
+  if (slot == NOT_IN_WHEEL) return;
+  
+  if (wheelPrev[index] != NO_MACHINE) {
+    wheelNext[wheelPrev[index]] = wheelNext[index];
+  } else {
+    wheel[slot] = wheelNext[index];
+  }
+  if (wheelNext[index] != NO_MACHINE) wheelPrev[wheelNext[index]] = wheelPrev[index];
+  wheelSlot[index] = NOT_IN_WHEEL;
+}
+
+void EsmScheduler::advanceWheel(unsigned long now) {
+  unsigned long elapsed = now - wheelTime;
+  if (elapsed == 0) return;
+  
+  // Solo gli slot dei millisecondi trascorsi, al massimo un giro completo
+  unsigned long steps = elapsed < ESM_SCHEDULER_WHEEL_SLOTS ? elapsed : ESM_SCHEDULER_WHEEL_SLOTS;
+  for (unsigned long step = 1; step <= steps; step++) {
+    uint16_t slot = (wheelTime + step) & (ESM_SCHEDULER_WHEEL_SLOTS - 1);
+    uint8_t index = wheel[slot];
+    while (index != NO_MACHINE) {
+      uint8_t next = wheelNext[index];
+      if ((long)(now - wakeupAt[index]) >= 0) {
+        wheelRemove(index);
+        markReady(index);
+      }
+      index = next;
+    }
+  }
+  wheelTime = now;
+}
+
+void EsmScheduler::reschedule(uint8_t index) {
+  EventStateMachine* machine = machines[index];
+  if (machine == nullptr) return;
+  
+  // Lavoro rimasto (eventi oltre maxEventsPerUpdate, trace, log): passaggio successivo
+  EsmTime wakeup;
+  bool waiting = machine->getNextWakeup(wakeup);
+  if (machine->hasPendingWork() || (waiting && esmClock() >= wakeup)) {
+    wheelRemove(index);
+    markReady(index);
+  } else if (waiting) {
+    // Slot del millisecondo in cui la sveglia è già raggiunta
+    wheelInsert(index, (unsigned long)esmTicksToMillis(wakeup + ESM_CLOCK_TICKS_PER_MS - 1));
+  } else {
+    wheelRemove(index);
+  }
+}
+
+size_t EsmScheduler::run() {
+  advanceWheel((unsigned long)esmMillis());
+  
+  // Ogni parola della ready list viene presa in blocco: le macchine segnate
+  // durante il passaggio vengono eseguite dal run() successivo
+  size_t executed = 0;
+  for (uint8_t w = 0; w < READY_WORDS; w++) {
+    uint32_t pending = ready[w].exchange(0, std::memory_order_acq_rel);
+    while (pending != 0) {
+      uint8_t index = w * 32 + __builtin_ctz(pending);
+      pending &= pending - 1;
+  
+      // Rimossa dopo essere stata segnata
+      EventStateMachine* machine = machines[index];
+      if (machine == nullptr) continue;
+  
+      dispatching = machine;
+      machine->processTimeouts();
+      machine->update();
+      dispatching = nullptr;
+      reschedule(index);
+      executed++;
+    }
+  }
+  return executed;
+}
+
+unsigned long EsmScheduler::getTimeToNextWakeup() const {
+  for (uint8_t w = 0; w < READY_WORDS; w++) {
+    if (ready[w].load(std::memory_order_acquire) != 0) return 0;
+  }
+  
+  // Gli slot in ordine di tempo a partire dal primo non ancora scandito: la prima
+  // sveglia entro un giro è la più vicina. Oltre un giro basta ricontrollare dopo
+  unsigned long now = (unsigned long)esmMillis();
+  bool waiting = false;
+  for (unsigned long step = 1; step <= ESM_SCHEDULER_WHEEL_SLOTS; step++) {
+    uint8_t index = wheel[(wheelTime + step) & (ESM_SCHEDULER_WHEEL_SLOTS - 1)];
+    for (; index != NO_MACHINE; index = wheelNext[index]) {
+      waiting = true;
+      if (wakeupAt[index] - wheelTime > ESM_SCHEDULER_WHEEL_SLOTS) continue;
+      long remaining = (long)(wakeupAt[index] - now);
+      return remaining > 0 ? (unsigned long)remaining : 0;
+    }
+  }
+  if (!waiting) return ESM_NO_TIMEOUT;
+  
+  long remaining = (long)(wheelTime + ESM_SCHEDULER_WHEEL_SLOTS - now);
+  return remaining > 0 ? (unsigned long)remaining : 0;
+}
+
+#if defined(ESP32) && !defined(ESM_HOST)
+bool EsmScheduler::begin(BaseType_t core, UBaseType_t priority, uint32_t stackSize) {
+  if (task != nullptr) return false;
+  return xTaskCreatePinnedToCore(taskMain, "esm_scheduler", stackSize, this, priority, &task, core) == pdPASS;
+}
+
+void EsmScheduler::taskMain(void* argument) {
+  EsmScheduler* scheduler = static_cast<EsmScheduler*>(argument);
+  
+#if ESM_THREAD_SAFE
+  // setState() e postEvent() degli altri task vengono inoltrati a questo task
+  for (uint8_t i = 0; i < ESM_SCHEDULER_MAX_MACHINES; i++) {
+    if (scheduler->machines[i] != nullptr) scheduler->machines[i]->setOwnerTask();
+  }
+#endif
+  
+  for (;;) {
+    scheduler->run();
+  
+    // Dorme fino alla prossima sveglia o a un wake(). Con macchine sempre pronte
+    // (onState continui) attende comunque un tick per lasciare girare gli altri task
+    unsigned long wait = scheduler->getTimeToNextWakeup();
+    TickType_t ticks = wait == ESM_NO_TIMEOUT ? portMAX_DELAY : pdMS_TO_TICKS(wait);
+    ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+  }
+}
+#endif
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
@@ -0,0 +1,103 @@
+/*
+  EsmScheduler.h - Executor driving many EventStateMachine instances
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_SCHEDULER_H
+#define EVENT_STATE_MACHINE_SCHEDULER_H
+
+#include "EventStateMachine.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+// Numero massimo di macchine per scheduler (multiplo di 32, al massimo 224)
+#ifndef ESM_SCHEDULER_MAX_MACHINES
+#define ESM_SCHEDULER_MAX_MACHINES 64
+#endif
+
+// Slot della ruota dei timer, uno per millisecondo (potenza di 2): una sveglia
+// oltre un giro resta nel suo slot e viene ricontrollata a ogni passaggio
+#ifndef ESM_SCHEDULER_WHEEL_SLOTS
+#define ESM_SCHEDULER_WHEEL_SLOTS 256
+#endif
+
+// Esegue un gruppo di macchine al posto degli update() chiamati uno per uno.
+// Ogni macchina registra una sola sveglia (il timeout o l'onState più vicino)
+// nella ruota condivisa, al posto del proprio Ticker; postEvent(), setState() e le
+// richieste degli altri task la inseriscono nella ready list. run() chiama solo le
+// macchine pronte: il costo di un ciclo dipende dalle macchine attive, non dal totale.
+// add() e remove() vanno chiamati dal contesto che esegue run()
+class EsmScheduler {
+public:
+  EsmScheduler();
+  ~EsmScheduler();
+  
+  // false se lo scheduler è pieno o la macchina appartiene già a uno scheduler
+  bool add(EventStateMachine& machine);
+  bool remove(EventStateMachine& machine);
+  
+  // Un passaggio: sposta nella ready list le sveglie scadute, poi esegue timeout e
+  // update() di ogni macchina pronta. Restituisce il numero di macchine eseguite
+  size_t run();
+  
+  // Millisecondi alla prossima sveglia (0 se ci sono macchine pronte),
+  // ESM_NO_TIMEOUT se nessuna macchina attende qualcosa
+  unsigned long getTimeToNextWakeup() const;
+  
+  size_t getMachineCount() const { return machineCount; }
+  
+  // Inserisce la macchina nella ready list; lock-free, da qualsiasi task e dagli interrupt
+  void wake(const EventStateMachine& machine);
+  
+#if defined(ESP32) && !defined(ESM_HOST)
+  // Esegue run() in un task dedicato fissato su 'core' (0 o 1, tskNO_AFFINITY per
+  // nessun vincolo): il task dorme fino alla prossima sveglia o a un wake().
+  // Con più scheduler si distribuiscono gruppi di macchine sui due core. Da
+  // chiamare una volta, dopo avere aggiunto le macchine
+  bool begin(BaseType_t core, UBaseType_t priority = 1, uint32_t stackSize = 4096);
+  TaskHandle_t getTask() const { return task; }
+#endif
+  
+private:
+  static const uint8_t NO_MACHINE = 0xFF;
+  static const uint8_t READY_WORDS = ESM_SCHEDULER_MAX_MACHINES / 32;
+  
+  static_assert(ESM_SCHEDULER_MAX_MACHINES % 32 == 0 && ESM_SCHEDULER_MAX_MACHINES <= 224,
+                "ESM_SCHEDULER_MAX_MACHINES must be a multiple of 32, at most 224");
+  static_assert((ESM_SCHEDULER_WHEEL_SLOTS & (ESM_SCHEDULER_WHEEL_SLOTS - 1)) == 0,
+                "ESM_SCHEDULER_WHEEL_SLOTS must be a power of two");
+  
+  EventStateMachine* machines[ESM_SCHEDULER_MAX_MACHINES];
+  size_t machineCount;
+  
+  // Ready list: un bit per macchina, impostato con fetch_or da qualsiasi contesto
+  std::atomic<uint32_t> ready[READY_WORDS];
+  
+  // Ruota dei timer: liste doppie intrusive di indici, una per slot
+  uint8_t wheel[ESM_SCHEDULER_WHEEL_SLOTS];
+  uint8_t wheelNext[ESM_SCHEDULER_MAX_MACHINES];
+  uint8_t wheelPrev[ESM_SCHEDULER_MAX_MACHINES];
+  uint16_t wheelSlot[ESM_SCHEDULER_MAX_MACHINES];     // ESM_SCHEDULER_WHEEL_SLOTS = fuori dalla ruota
+  unsigned long wakeupAt[ESM_SCHEDULER_MAX_MACHINES];
+  unsigned long wheelTime;                            // Ultimo millisecondo già scandito
+  
+  // Macchina in esecuzione: le sue notifiche sono superflue, run() la rischedula
+  EventStateMachine* dispatching;
+  
+#if defined(ESP32) && !defined(ESM_HOST)
+  TaskHandle_t task;
+  static void taskMain(void* scheduler);
+#endif
+  
+  friend class EventStateMachine;
+  void notify(const EventStateMachine& machine);     // Notifica dal contesto proprietario
+  void markReady(uint8_t index);
+  void reschedule(uint8_t index);                    // Dopo l'esecuzione: ready list, ruota o niente
+  void wheelInsert(uint8_t index, unsigned long wakeup);
+  void wheelRemove(uint8_t index);
+  void advanceWheel(unsigned long now);
+};
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // EVENT_STATE_MACHINE_SCHEDULER_H
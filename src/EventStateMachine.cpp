@@ -4,277 +4,2012 @@
   Released under MIT License.
 */
 #include "EventStateMachine.h"
+#include "StatePersistence.h"
+#include "EsmScheduler.h"
+#if defined(ESP32) && !defined(ESM_HOST)
+#include <esp_sleep.h>
+#endif
 
-#if defined(ESP8266) || defined(ESP32)
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
 
-// Inizializzazione della variabile statica
-EventStateMachine* EventStateMachine::instance = nullptr;
+// Funzione statica per il callback del Ticker, l'argomento è l'istanza che lo ha armato
+void EventStateMachine::onTimeoutStatic(EventStateMachine* machine) {
+  machine->onTimerExpired();
+}
+
+// Il TimeoutEvent armato viene conservato impacchettato in 32 bit (lettura atomica dal Ticker)
+static uint32_t packTimeoutEvent(const TimeoutEvent& event) {
+  return (uint32_t)event.state | ((uint32_t)event.generation << 16);
+}
+
+static TimeoutEvent unpackTimeoutEvent(uint32_t packedEvent) {
+  TimeoutEvent event;
+  event.state = packedEvent & 0xFFFF;
+  event.generation = packedEvent >> 16;
+  return event;
+}
+
+void EventStateMachine::onTimerExpired() {
+  if (!deferredTimeouts) {
+    processTimeouts();
+    return;
+  }
+  
+  // Contesto del Ticker: solo un push nella coda lock-free, nessun callback utente
+  uint32_t packedEvent = armedTimeout.load(std::memory_order_acquire);
+  if (!timeoutEvents.push(unpackTimeoutEvent(packedEvent))) {
+    timeoutEventsOverflow.store(true, std::memory_order_release);
+  }
+}
+
+void EventStateMachine::scheduleTimeouts(StateId state, EsmTime now) {
+  size_t count = timeoutCount(state);
+  
+  for (size_t i = 0; i < count; i++) {
+    TimeoutInfo timeoutInfo = timeoutAt(state, i);
+    if (timeoutInfo.callback == nullptr) continue;
+    
+    unsigned long duration = timeoutInfo.duration;
+    pendingTimeouts.push_back({now + esmMillisToTicks(duration), (uint8_t)i, state, stateGeneration});
+    std::push_heap(pendingTimeouts.begin(), pendingTimeouts.end(), timeoutExpiresLater);
+    
+    ESM_TRACE(TRACE_TIMEOUT_SET, state, i, duration);
+  }
+}
+
+void EventStateMachine::cancelTimeouts(StateId state) {
+  if (pendingTimeouts.empty()) return;
+  
+  // Le scadenze degli antenati che restano attivi non vengono toccate;
+  // erase() mantiene la capacità: nessuna allocazione al prossimo setState()
+  auto last = std::remove_if(pendingTimeouts.begin(), pendingTimeouts.end(),
+                             [state](const TimeoutEntry& entry) { return entry.state == state; });
+  if (last == pendingTimeouts.end()) return;
+  
+  pendingTimeouts.erase(last, pendingTimeouts.end());
+  std::make_heap(pendingTimeouts.begin(), pendingTimeouts.end(), timeoutExpiresLater);
+  if (pendingTimeouts.empty()) {
+    detachTimeoutTicker();
+  }
+}
+
+void EventStateMachine::detachTimeoutTicker() {
+  // Dopo lo scatto il flag può restare vero: al più un detach() in più
+  if (!timeoutTickerArmed) return;
+  timeoutTicker.detach();
+  timeoutTickerArmed = false;
+}
+
+void EventStateMachine::armTimeoutTicker() {
+  // Con uno scheduler la scadenza più vicina finisce nella sua ruota dei timer
+  if (scheduler != nullptr) {
+    notifyScheduler();
+    return;
+  }
+  
+  if (pendingTimeouts.empty()) {
+    detachTimeoutTicker();
+    return;
+  }
+  
+  const TimeoutEntry& next = pendingTimeouts.front();
+  TimeoutEvent event = {next.state, stateGeneration};
+  EsmTime now = esmClock();
+  uint32_t remaining = next.deadline > now ? esmTicksToWait(next.deadline - now) : 0;
+  armedTimeout.store(packTimeoutEvent(event), std::memory_order_release);
+  timeoutTicker.once_ms(remaining, onTimeoutStatic, this);
+  timeoutTickerArmed = true;
+}
+
+void EventStateMachine::unschedulePendingTimeout(StateId state, uint8_t timeoutIndex) {
+  // Le posizioni dei timeout sono stabili: basta togliere la scadenza
+  auto last = std::remove_if(pendingTimeouts.begin(), pendingTimeouts.end(),
+                             [state, timeoutIndex](const TimeoutEntry& entry) {
+                               return entry.state == state && entry.index == timeoutIndex;
+                             });
+  if (last == pendingTimeouts.end()) return;
+  
+  pendingTimeouts.erase(last, pendingTimeouts.end());
+  std::make_heap(pendingTimeouts.begin(), pendingTimeouts.end(), timeoutExpiresLater);
+  armTimeoutTicker();
+}
+
+void EventStateMachine::reschedulePeriodic(const TimeoutEntry& expired) {
+  if (expired.index >= timeoutCount(expired.state)) return;
+  TimeoutInfo timeoutInfo = timeoutAt(expired.state, expired.index);
+  if (!timeoutInfo.periodic || timeoutInfo.callback == nullptr) return;
+  
+  // Periodo riferito alla scadenza precedente (nessuna deriva); se è già
+  // trascorso riparte da adesso
+  EsmTime period = esmMillisToTicks(timeoutInfo.duration);
+  EsmTime deadline = expired.deadline + period;
+  EsmTime now = esmClock();
+  if (now >= deadline) {
+    deadline = now + period;
+  }
+  
+  pendingTimeouts.push_back({deadline, expired.index, expired.state, expired.generation});
+  std::push_heap(pendingTimeouts.begin(), pendingTimeouts.end(), timeoutExpiresLater);
+}
+
+void EventStateMachine::processTimeouts() {
+  uint16_t generation = stateGeneration;
+  
+  // Esegue tutte le scadenze raggiunte; dopo un setState() nel callback le scadenze
+  // rimaste vengono riprese dal Ticker riarmato
+  while (!pendingTimeouts.empty() && stateGeneration == generation) {
+    const TimeoutEntry& next = pendingTimeouts.front();
+    if (readClock() < next.deadline) break;
+    
+    TimeoutEntry expired = next;
+    std::pop_heap(pendingTimeouts.begin(), pendingTimeouts.end(), timeoutExpiresLater);
+    pendingTimeouts.pop_back();
+    
+    // Scadenza di una visita precedente dello stato: scartata in O(1) prima del callback
+    if (expired.generation != states[expired.state]->visitGeneration) {
+      ESM_TRACE(TRACE_TIMEOUT_DROPPED, expired.state, expired.index, expired.generation);
+      continue;
+    }
+    
+    // Attesa di un corpo di stato: scaduto il ritardo o la scadenza dell'evento
+    if (expired.index == TASK_TIMEOUT_INDEX) {
+      StateTask& task = *states[expired.state]->task;
+      task.expired = task.status == TASK_WAIT_EVENT;
+      resumeTask(expired.state);
+      continue;
+    }
+    
+    // Il timer periodico viene riaccodato prima del callback: se questo lo rimuove
+    // o esce dallo stato la nuova scadenza viene tolta insieme alle altre
+    reschedulePeriodic(expired);
+    
+    onTimeout(expired.state, expired.index);
+  }
+  
+  armTimeoutTicker();
+}
+
+void EventStateMachine::processDeferredTimeouts() {
+  bool due = timeoutEventsOverflow.exchange(false, std::memory_order_acq_rel);
+  
+  // Scarta in O(1) i record delle visite precedenti: con la stessa generazione
+  // non ci sono state transizioni e lo stato armato è ancora attivo
+  TimeoutEvent event;
+  while (timeoutEvents.pop(event)) {
+    if (event.generation == stateGeneration) {
+      due = true;
+    } else {
+      ESM_TRACE(TRACE_TIMEOUT_DROPPED, event.state, 0, event.generation);
+    }
+  }
+  
+  if (due) {
+    processTimeouts();
+  }
+}
+
+#if ESM_TRACE_LEVEL > 0
+void EventStateMachine::trace(uint8_t type, StateId state, uint8_t index, uint32_t value) {
+  TraceEvent event;
+  event.timestamp = (uint32_t)esmTicksToMicros(esmClock());
+  event.type = type;
+  event.state = state;
+  event.index = index;
+  event.value = value;
+  
+#if defined(ESP32)
+  portENTER_CRITICAL(&traceLock);
+#endif
+  bool stored = traceEvents.push(event);
+#if defined(ESP32)
+  portEXIT_CRITICAL(&traceLock);
+#endif
+  
+  if (!stored) {
+    droppedTraceEvents.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+#endif
+
+void EventStateMachine::setDebugOutput(Print* out) {
+#if ESM_TRACE_LEVEL > 0
+  traceOutput = out;
+#else
+  (void)out;
+#endif
+}
+
+bool EventStateMachine::popTraceEvent(TraceEvent& event) {
+#if ESM_TRACE_LEVEL > 0
+  return traceEvents.pop(event);
+#else
+  (void)event;
+  return false;
+#endif
+}
+
+void EventStateMachine::printTrace(Print& out, size_t maxEvents) {
+#if ESM_TRACE_LEVEL > 0
+  TraceEvent event;
+  for (size_t printed = 0; printed < maxEvents && traceEvents.pop(event); printed++) {
+    printTraceEvent(out, event);
+  }
+#else
+  (void)out;
+  (void)maxEvents;
+#endif
+}
+
+uint32_t EventStateMachine::getDroppedTraceEvents() const {
+#if ESM_TRACE_LEVEL > 0
+  return droppedTraceEvents.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
+
+void EventStateMachine::setDeferredTimeouts(bool enable) {
+#if ESM_THREAD_SAFE && defined(ESP32)
+  // Il Ticker gira in un altro task: la dispatch diretta non è ammessa
+  enable = true;
+#endif
+  if (deferredTimeouts == enable) return;
+  deferredTimeouts = enable;
+  
+  // Riarma il Ticker: le scadenze già raggiunte vengono gestite con la nuova modalità
+  timeoutEvents.clear();
+  armTimeoutTicker();
+}
+
+void EventStateMachine::onTimeout(StateId state, uint8_t timeoutIndex) {
+  // Verifica che lo stato per cui il timeout è stato impostato sia ancora attivo
+  if (!isInState(state) || timeoutIndex >= timeoutCount(state)) return;
+  
+  // Copia: il callback può rimuovere o aggiungere timeout durante l'esecuzione
+  StateDelegate callback = timeoutAt(state, timeoutIndex).callback;
+  if (callback == nullptr) return;
+  
+  ESM_TRACE(TRACE_TIMEOUT_FIRED, state, timeoutIndex, 0);
+  if (stateStatistics != nullptr) stateStatistics[state].timeoutsFired++;
+  
+#if ESM_PROFILING
+  uint32_t start = ESM_PROFILE_CLOCK();
+#endif
+  
+  // Un setState() nel callback viene registrato come transizione per timeout
+  uint8_t savedCause = activeCause;
+  uint8_t savedDetail = activeDetail;
+  activeCause = TRANSITION_TIMEOUT;
+  activeDetail = timeoutIndex;
+  callback(state, regions[regionOf(state)].previous);
+  activeCause = savedCause;
+  activeDetail = savedDetail;
+  
+#if ESM_PROFILING
+  // Il contatore viene cercato dopo il callback, che può riallocare la lista
+  uint32_t elapsed = ESM_PROFILE_CLOCK() - start;
+  ProfileCounter& counter = frozen
+    ? frozenProfiles[states[state]->frozenSpan.offset + states[state]->frozenSpan.numEnters + states[state]->frozenSpan.numStates + states[state]->frozenSpan.numExits + timeoutIndex]
+    : states[state]->timeoutProfiles[timeoutIndex];
+  counter.record(elapsed);
+  states[state]->profile.timeouts.record(elapsed);
+#endif
+}
+
+bool EventStateMachine::isValidState(StateId state) const {
+  return state < numStates;
+}
+
+uint8_t EventStateMachine::stateDepth(StateId state) const {
+  uint8_t depth = 0;
+  for (StateId s = state; s != ESM_NO_STATE; s = states[s]->parent) {
+    depth++;
+  }
+  return depth;
+}
+
+StateId EventStateMachine::commonAncestor(StateId a, StateId b) const {
+  uint8_t depthA = stateDepth(a);
+  uint8_t depthB = stateDepth(b);
+  
+  // Porta i due stati alla stessa profondità, poi risale in parallelo
+  for (; depthA > depthB; depthA--) a = states[a]->parent;
+  for (; depthB > depthA; depthB--) b = states[b]->parent;
+  while (a != b) {
+    a = states[a]->parent;
+    b = states[b]->parent;
+  }
+  return a;
+}
+
+bool EventStateMachine::setParent(StateId state, StateId parent) {
+  if (!assignParent(state, parent)) return false;
+  reserveTimeouts();
+  return true;
+}
+
+bool EventStateMachine::assignParent(StateId state, StateId parent) {
+  if (!isValidState(state)) return false;
+  if (parent != ESM_NO_STATE) {
+    if (!isValidState(parent)) return false;
+    
+    // Il padre non può discendere dallo stato stesso
+    for (StateId s = parent; s != ESM_NO_STATE; s = states[s]->parent) {
+      if (s == state) return false;
+    }
+    
+    // Verifica la profondità di tutti i discendenti dello stato
+    uint8_t parentDepth = stateDepth(parent);
+    for (StateId s = 0; s < numStates; s++) {
+      uint8_t depth = 0;
+      StateId ancestor = s;
+      while (ancestor != ESM_NO_STATE && ancestor != state) {
+        ancestor = states[ancestor]->parent;
+        depth++;
+      }
+      if (ancestor == state && parentDepth + depth + 1 > ESM_MAX_STATE_DEPTH) return false;
+    }
+  }
+  
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return false;
+  def->parent = parent;
+  return true;
+}
+
+StateId EventStateMachine::getParent(StateId state) const {
+  if (!isValidState(state)) return ESM_NO_STATE;
+  return states[state]->parent;
+}
+
+bool EventStateMachine::isInState(StateId state) const {
+  if (!isValidState(state)) return false;
+  for (StateId s = regions[regionOf(state)].current; s != ESM_NO_STATE; s = states[s]->parent) {
+    if (s == state) return true;
+  }
+  return false;
+}
+
+void EventStateMachine::reserveTimeouts() {
+  // Nella coda ci sono le scadenze della catena attiva di ogni regione: timeout
+  // dello stato e dei suoi antenati, più l'attesa di ogni corpo (TASK_TIMEOUT_INDEX)
+  size_t regionPending[ESM_MAX_REGIONS] = {};
+  for (StateId s = 0; s < numStates; s++) {
+    // Uno stato non configurato non ha né timeout né antenati
+    if (states[s] == &emptyState) continue;
+    
+    size_t pending = 0;
+    for (StateId ancestor = s; ancestor != ESM_NO_STATE; ancestor = states[ancestor]->parent) {
+      pending += timeoutCount(ancestor);
+      if (states[ancestor]->flags & STATE_HAS_TASK) pending++;
+    }
+    uint8_t region = regionOf(s);
+    if (pending > regionPending[region]) regionPending[region] = pending;
+  }
+  
+  size_t maxPending = 0;
+  for (uint8_t r = 0; r < regionCount; r++) {
+    maxPending += regionPending[r];
+  }
+  if (pendingTimeouts.capacity() < maxPending) {
+    pendingTimeouts.reserve(maxPending);
+  }
+}
+
+StateDefinition EventStateMachine::emptyState;
+StateDefinition* EventStateMachine::emptyStateTable[1] = { &EventStateMachine::emptyState };
+
+EventStateMachine::EventStateMachine(StateId numberOfStates, EsmAllocator* memory) {
+  allocator = memory != nullptr ? memory : &EsmAllocator::heap();
+  
+  // I vector vuoti ricevono l'allocatore: le assegnazioni lo propagano
+  EsmStlAllocator<uint8_t> dispatchMemory(allocator, ESM_MEMORY_DISPATCH);
+  pendingTimeouts = EsmVector<TimeoutEntry>(dispatchMemory);
+  frozenCallbacks = EsmVector<FrozenCallback>(dispatchMemory);
+#if ESM_PROFILING
+  frozenProfiles = EsmVector<ProfileCounter>(dispatchMemory);
+#endif
+  beforeStateChangeHandlers = CallbackList<GlobalStateDelegate>(dispatchMemory);
+  afterStateChangeHandlers = CallbackList<GlobalStateDelegate>(dispatchMemory);
+  
+  // ESM_NO_STATE non è un identificativo valido
+  numStates = numberOfStates < ESM_NO_STATE ? numberOfStates : ESM_NO_STATE;
+  states = static_cast<StateDefinition**>(allocator->allocate(numStates * sizeof(StateDefinition*), ESM_MEMORY_DISPATCH));
+  if (states == nullptr) {
+    // Tabella non allocata: nessuno stato valido, ogni configurazione viene rifiutata.
+    // Lo stato 0 corrente punta a emptyState, che non viene mai modificato
+    states = emptyStateTable;
+    numStates = 0;
+  }
+  for (StateId s = 0; s < numStates; s++) {
+#if ESM_PROFILING
+    // Il profiler scrive le statistiche di ogni stato visitato; senza memoria lo
+    // stato resta su emptyState e i suoi contatori non sono significativi
+    states[s] = createDefinition();
+    if (states[s] == nullptr) states[s] = &emptyState;
+#else
+    states[s] = &emptyState;
+#endif
+  }
+  currentState = 0;
+  previousState = 0;
+  stateChanged = true;
+  clockTime = esmClock();
+  stateEnteredTime = clockTime;
+  debugEnabled = false;
+#if ESM_TRACE_LEVEL > 0
+  droppedTraceEvents = 0;
+  traceOutput = &Serial;
+#if defined(ESP32)
+  traceLock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+#endif
+  definitionBlock = nullptr;
+  definitionBlockSize = 0;
+  frozen = false;
+  persistence = nullptr;
+  handleGeneration = 0;
+  regions[0].current = 0;
+  regions[0].previous = 0;
+  regions[0].enteredTime = stateEnteredTime;
+  regions[0].statisticsVisitStart = 0;
+#if ESM_PROFILING
+  regions[0].profileStart = stateEnteredTime;
+#endif
+  regionCount = 1;
+  deferredTimeouts = false;
+  stateGeneration = 1;
+  timeoutEventsOverflow = false;
+  armedTimeout = 0;
+  timeoutTickerArmed = false;
+  maxEventsPerUpdate = ESM_EVENT_QUEUE_SIZE;
+  inTransition = false;
+  hasPendingState = false;
+  pendingState = 0;
+  allowedTransitions = nullptr;
+  rejectedTransitions = 0;
+  droppedStateRequests = 0;
+  stateStatistics = nullptr;
+  transitionPairs = nullptr;
+  scheduler = nullptr;
+  schedulerIndex = 0;
+  activeCause = TRANSITION_DIRECT;
+  activeDetail = 0;
+  pendingCause = TRANSITION_DIRECT;
+  pendingDetail = 0;
+#if ESM_HISTORY_SIZE > 0
+  historySequence = 0;
+#endif
+  
+#if ESM_THREAD_SAFE
+  concurrencyStats = ConcurrencyStats();
+#if defined(ESP32)
+  ownerTask = nullptr;
+  requestLock = portMUX_INITIALIZER_UNLOCKED;
+  
+  // Con più core il Ticker gira in un altro task: i timeout sono sempre differiti
+  deferredTimeouts = true;
+#endif
+#endif
+}
+
+EventStateMachine::~EventStateMachine() {
+  if (scheduler != nullptr) {
+    scheduler->remove(*this);
+  }
+  
+  // Ferma il Ticker condiviso
+  timeoutTicker.detach();
+  
+  for (StateId s = 0; s < numStates; s++) {
+    if (states[s]->task != nullptr) destroyTask(*states[s]);
+    if (states[s] != &emptyState && !isBlockDefinition(states[s])) destroyDefinition(states[s]);
+  }
+  if (definitionBlock != nullptr) {
+    for (StateId i = 0; i < definitionBlockSize; i++) {
+      definitionBlock[i].~StateDefinition();
+    }
+    allocator->deallocate(definitionBlock, definitionBlockSize * sizeof(StateDefinition), ESM_MEMORY_CONFIG);
+  }
+  if (states != emptyStateTable) {
+    allocator->deallocate(states, numStates * sizeof(StateDefinition*), ESM_MEMORY_DISPATCH);
+  }
+  if (stateStatistics != nullptr) {
+    allocator->deallocate(stateStatistics, numStates * sizeof(StateStatistics), ESM_MEMORY_DISPATCH);
+    allocator->deallocate(transitionPairs, (size_t)numStates * numStates * sizeof(uint32_t), ESM_MEMORY_DISPATCH);
+  }
+}
+
+StateDefinition* EventStateMachine::createDefinition() {
+  void* memory = allocator->allocate(sizeof(StateDefinition), ESM_MEMORY_CONFIG);
+  if (memory == nullptr) return nullptr;
+  return new (memory) StateDefinition(allocator);
+}
+
+void EventStateMachine::destroyDefinition(StateDefinition* definition) {
+  definition->~StateDefinition();
+  allocator->deallocate(definition, sizeof(StateDefinition), ESM_MEMORY_CONFIG);
+}
+
+StateDefinition* EventStateMachine::defineState(StateId state) {
+  if (states[state] == &emptyState) {
+    StateDefinition* definition = createDefinition();
+    if (definition == nullptr) return nullptr;
+    states[state] = definition;
+  }
+  return states[state];
+}
+
+void EventStateMachine::runOnEnters(StateId state, StateId otherState) {
+  if (frozen) {
+    const FrozenSpan& span = states[state]->frozenSpan;
+    const FrozenCallback* entry = &frozenCallbacks[span.offset];
+    for (uint8_t i = 0; i < span.numEnters; i++) {
+      if (entry[i].generation == 0) continue;
+      ESM_PROFILED(frozenProfiles[span.offset + i], entry[i].callback(state, otherState));
+    }
+    return;
+  }
+  
+  // Indici e copia del delegate: un callback può aggiungere o rimuovere voci
+  // della lista; quelle aggiunte vengono eseguite dal passaggio successivo
+  const auto& onEnters = states[state]->onEnters;
+  size_t count = onEnters.size();
+  for (size_t i = 0; i < count; i++) {
+    if (!onEnters.isActive(i)) continue;
+    StateDelegate callback = onEnters[i];
+    ESM_PROFILED(states[state]->enterProfiles[i], callback(state, otherState));
+  }
+}
+
+void EventStateMachine::runOnStates(StateId state) {
+  // Stato con intervallo: fuori dalla prossima esecuzione prevista non fa nulla
+  StateDefinition& def = *states[state];
+  if (def.onStateInterval > 0) {
+    EsmTime now = clockTime;
+    if (now < def.nextOnStateRun) return;
+    
+    // Intervallo riferito all'esecuzione prevista; dopo un ritardo riparte da adesso
+    EsmTime interval = esmMillisToTicks(def.onStateInterval);
+    def.nextOnStateRun += interval;
+    if (now >= def.nextOnStateRun) {
+      def.nextOnStateRun = now + interval;
+    }
+  }
+  
+  if (frozen) {
+    const FrozenSpan& span = states[state]->frozenSpan;
+    const FrozenCallback* entry = &frozenCallbacks[span.offset + span.numEnters];
+    for (uint8_t i = 0; i < span.numStates; i++) {
+      if (entry[i].generation == 0) continue;
+      ESM_PROFILED(frozenProfiles[span.offset + span.numEnters + i], entry[i].function(state));
+    }
+    return;
+  }
+  
+  // Indici e copia del delegate: un callback può aggiungere o rimuovere voci
+  // della lista; quelle aggiunte vengono eseguite dal passaggio successivo
+  const auto& onStates = states[state]->onStates;
+  size_t count = onStates.size();
+  for (size_t i = 0; i < count; i++) {
+    if (!onStates.isActive(i)) continue;
+    StateFunctionDelegate callback = onStates[i];
+    ESM_PROFILED(states[state]->stateProfiles[i], callback(state));
+  }
+}
+
+void EventStateMachine::runActiveStates(StateId state) {
+  // Stato senza padre: nessuna catena da ricostruire
+  if (states[state]->parent == ESM_NO_STATE) {
+    if (states[state]->flags & STATE_HAS_STATES) runOnStates(state);
+    return;
+  }
+  
+  StateId path[ESM_MAX_STATE_DEPTH];
+  uint8_t depth = 0;
+  for (StateId s = state; s != ESM_NO_STATE; s = states[s]->parent) {
+    path[depth++] = s;
+  }
+  
+  // Prima gli antenati, poi lo stato foglia; si ferma se un callback cambia stato
+  uint16_t generation = stateGeneration;
+  while (depth > 0 && stateGeneration == generation) {
+    StateId s = path[--depth];
+    if (states[s]->flags & STATE_HAS_STATES) runOnStates(s);
+  }
+}
+
+void EventStateMachine::runOnExits(StateId state, StateId otherState) {
+  if (frozen) {
+    const FrozenSpan& span = states[state]->frozenSpan;
+    const FrozenCallback* entry = &frozenCallbacks[span.offset + span.numEnters + span.numStates];
+    for (uint8_t i = 0; i < span.numExits; i++) {
+      if (entry[i].generation == 0) continue;
+      ESM_PROFILED(frozenProfiles[span.offset + span.numEnters + span.numStates + i], entry[i].callback(state, otherState));
+    }
+    return;
+  }
+  
+  // Indici e copia del delegate: un callback può aggiungere o rimuovere voci
+  // della lista; quelle aggiunte vengono eseguite dal passaggio successivo
+  const auto& onExits = states[state]->onExits;
+  size_t count = onExits.size();
+  for (size_t i = 0; i < count; i++) {
+    if (!onExits.isActive(i)) continue;
+    StateDelegate callback = onExits[i];
+    ESM_PROFILED(states[state]->exitProfiles[i], callback(state, otherState));
+  }
+}
+
+void EventStateMachine::updateStateFlags(StateId state) {
+  if (states[state] == &emptyState) return;
+  
+  StateDefinition& def = *states[state];
+  uint8_t flags = 0;
+  if (def.onEnters.count() > 0) flags |= STATE_HAS_ENTERS;
+  if (def.onStates.count() > 0) flags |= STATE_HAS_STATES;
+  if (def.onExits.count() > 0) flags |= STATE_HAS_EXITS;
+  if (def.timeouts.count() > 0) flags |= STATE_HAS_TIMEOUTS;
+  if (def.task != nullptr) flags |= STATE_HAS_TASK;
+  def.flags = flags;
+}
+
+size_t EventStateMachine::timeoutCount(StateId state) const {
+  return frozen ? states[state]->frozenSpan.numTimeouts : states[state]->timeouts.size();
+}
+
+TimeoutInfo EventStateMachine::timeoutAt(StateId state, uint8_t timeoutIndex) const {
+  if (frozen) {
+    const FrozenSpan& span = states[state]->frozenSpan;
+    const FrozenCallback& entry = frozenCallbacks[span.offset + span.numEnters + span.numStates + span.numExits + timeoutIndex];
+    return {entry.duration, entry.callback, entry.periodic};
+  }
+  
+  return states[state]->timeouts[timeoutIndex];
+}
+
+bool EventStateMachine::freeze() {
+  if (frozen) return true;
+  
+  // Verifica i limiti degli intervalli prima di allocare
+  size_t total = 0;
+  for (StateId s = 0; s < numStates; s++) {
+    const StateDefinition& def = *states[s];
+    if (def.onEnters.size() > 255 || def.onStates.size() > 255 ||
+        def.onExits.size() > 255 || def.timeouts.size() > 255) return false;
+    total += def.onEnters.size() + def.onStates.size() + def.onExits.size() + def.timeouts.size();
+  }
+  if (total > 0xFFFF) return false;
+  
+  // Una sola allocazione di dimensione esatta per ciascun array
+  frozenCallbacks.reserve(total);
+#if ESM_PROFILING
+  frozenProfiles.reserve(total);
+#endif
+  
+  for (StateId s = 0; s < numStates; s++) {
+    // Gli stati non configurati restano su emptyState, con un intervallo vuoto
+    if (states[s] == &emptyState) continue;
+    
+    StateDefinition& def = *states[s];
+    FrozenSpan& span = def.frozenSpan;
+    FrozenCallback entry;
+    entry.duration = 0;
+    
+    span.offset = frozenCallbacks.size();
+    span.numEnters = def.onEnters.size();
+    span.numStates = def.onStates.size();
+    span.numExits = def.onExits.size();
+    span.numTimeouts = def.timeouts.size();
+    
+    // Le posizioni libere vengono copiate: indici e handle restano validi
+    for (size_t i = 0; i < def.onEnters.size(); i++) {
+      entry.callback = def.onEnters[i];
+      entry.generation = def.onEnters.generationAt(i);
+      frozenCallbacks.push_back(entry);
+    }
+    for (size_t i = 0; i < def.onStates.size(); i++) {
+      entry.function = def.onStates[i];
+      entry.generation = def.onStates.generationAt(i);
+      frozenCallbacks.push_back(entry);
+    }
+    for (size_t i = 0; i < def.onExits.size(); i++) {
+      entry.callback = def.onExits[i];
+      entry.generation = def.onExits.generationAt(i);
+      frozenCallbacks.push_back(entry);
+    }
+    for (size_t i = 0; i < def.timeouts.size(); i++) {
+      entry.callback = def.timeouts[i].callback;
+      entry.duration = def.timeouts[i].duration;
+      entry.periodic = def.timeouts[i].periodic;
+      entry.generation = def.timeouts.generationAt(i);
+      frozenCallbacks.push_back(entry);
+    }
+    
+#if ESM_PROFILING
+    frozenProfiles.insert(frozenProfiles.end(), def.enterProfiles.begin(), def.enterProfiles.end());
+    frozenProfiles.insert(frozenProfiles.end(), def.stateProfiles.begin(), def.stateProfiles.end());
+    frozenProfiles.insert(frozenProfiles.end(), def.exitProfiles.begin(), def.exitProfiles.end());
+    frozenProfiles.insert(frozenProfiles.end(), def.timeoutProfiles.begin(), def.timeoutProfiles.end());
+    EsmVector<ProfileCounter>(def.enterProfiles.get_allocator()).swap(def.enterProfiles);
+    EsmVector<ProfileCounter>(def.stateProfiles.get_allocator()).swap(def.stateProfiles);
+    EsmVector<ProfileCounter>(def.exitProfiles.get_allocator()).swap(def.exitProfiles);
+    EsmVector<ProfileCounter>(def.timeoutProfiles.get_allocator()).swap(def.timeoutProfiles);
+#endif
+    
+    // Libera la memoria delle liste ormai duplicate
+    def.onEnters.release();
+    def.onStates.release();
+    def.onExits.release();
+    def.timeouts.release();
+  }
+  
+  frozen = true;
+  return true;
+}
+
+void EventStateMachine::unfreeze() {
+  if (!frozen) return;
+  
+  // Ricostruisce le liste degli stati a partire dalla tabella compatta
+  for (StateId s = 0; s < numStates; s++) {
+    if (states[s] == &emptyState) continue;
+    
+    StateDefinition& def = *states[s];
+    const FrozenSpan& span = def.frozenSpan;
+    const FrozenCallback* entry = &frozenCallbacks[span.offset];
+    
+    def.onEnters.reserve(span.numEnters);
+    for (uint8_t i = 0; i < span.numEnters; i++, entry++) def.onEnters.restore(entry->callback, entry->generation);
+    def.onStates.reserve(span.numStates);
+    for (uint8_t i = 0; i < span.numStates; i++, entry++) def.onStates.restore(entry->function, entry->generation);
+    def.onExits.reserve(span.numExits);
+    for (uint8_t i = 0; i < span.numExits; i++, entry++) def.onExits.restore(entry->callback, entry->generation);
+    def.timeouts.reserve(span.numTimeouts);
+    for (uint8_t i = 0; i < span.numTimeouts; i++, entry++) def.timeouts.restore({entry->duration, entry->callback, entry->periodic}, entry->generation);
+    
+#if ESM_PROFILING
+    auto profile = frozenProfiles.begin() + span.offset;
+    def.enterProfiles.assign(profile, profile + span.numEnters);
+    profile += span.numEnters;
+    def.stateProfiles.assign(profile, profile + span.numStates);
+    profile += span.numStates;
+    def.exitProfiles.assign(profile, profile + span.numExits);
+    profile += span.numExits;
+    def.timeoutProfiles.assign(profile, profile + span.numTimeouts);
+#endif
+  }
+  
+#if ESM_PROFILING
+  EsmVector<ProfileCounter>(frozenProfiles.get_allocator()).swap(frozenProfiles);
+#endif
+  EsmVector<FrozenCallback>(frozenCallbacks.get_allocator()).swap(frozenCallbacks);
+  frozen = false;
+}
+
+void EventStateMachine::configureState(StateId state, unsigned long timeout,
+                  StateDelegate onEnter,
+                  StateFunctionDelegate onState,
+                  StateDelegate onExit,
+                  StateDelegate onTimeout) {
+  if (!isValidState(state)) return;
+  
+  // Aggiungi i callback se non sono nullptr
+  if (onEnter != nullptr) {
+    addOnEnter(state, onEnter);
+  }
+  
+  if (onState != nullptr) {
+    addOnState(state, onState);
+  }
+  
+  if (onExit != nullptr) {
+    addOnExit(state, onExit);
+  }
+  
+  if (timeout > 0 && onTimeout != nullptr) {
+    addTimeout(state, timeout, onTimeout);
+  }
+}
+
+// Tipi di callback codificati nel CallbackHandle
+enum CallbackKind : uint8_t {
+  CALLBACK_ENTER = 0,
+  CALLBACK_STATE,
+  CALLBACK_EXIT,
+  CALLBACK_TIMEOUT,
+  CALLBACK_BEFORE,
+  CALLBACK_AFTER
+};
+
+// CallbackHandle: generazione (13 bit) | tipo (3 bit) | stato (8 o 16 bit) | posizione (8 bit)
+static const unsigned HANDLE_KIND_SHIFT = 8 + 8 * sizeof(StateId);
+static const unsigned HANDLE_GENERATION_SHIFT = HANDLE_KIND_SHIFT + 3;
+
+static CallbackHandle makeHandle(uint8_t kind, StateId state, uint8_t index, uint16_t generation) {
+  return ((CallbackHandle)generation << HANDLE_GENERATION_SHIFT) | ((CallbackHandle)kind << HANDLE_KIND_SHIFT) |
+         ((CallbackHandle)state << 8) | index;
+}
+
+uint16_t EventStateMachine::nextHandleGeneration() {
+  // 0 indica una posizione libera: viene saltato al rollover
+  handleGeneration = (handleGeneration + 1) & 0x1FFF;
+  if (handleGeneration == 0) handleGeneration = 1;
+  return handleGeneration;
+}
+
+template <typename T>
+CallbackHandle EventStateMachine::registerCallback(CallbackList<T>& list, uint8_t kind, StateId state, const T& value) {
+  uint16_t generation = nextHandleGeneration();
+  int index = list.add(value, generation);
+  if (index < 0) return ESM_INVALID_HANDLE;
+  return makeHandle(kind, state, index, generation);
+}
+
+#if ESM_PROFILING
+// Il contatore segue la posizione del callback: azzerato quando la posizione viene riusata
+static void resetProfileSlot(EsmVector<ProfileCounter>& profiles, CallbackHandle handle) {
+  size_t index = handle & 0xFF;
+  if (index < profiles.size()) {
+    profiles[index] = ProfileCounter();
+  } else {
+    profiles.resize(index + 1);
+  }
+}
+#endif
+
+// Rimuove la prima voce attiva uguale a 'value'
+template <typename T>
+static int removeFirst(CallbackList<T>& list, const T& value) {
+  for (size_t i = 0; i < list.size(); i++) {
+    if (list.isActive(i) && list[i] == value) {
+      list.remove(i, list.generationAt(i));
+      return i;
+    }
+  }
+  return -1;
+}
+
+CallbackHandle EventStateMachine::addTimeout(StateId state, unsigned long timeout, StateDelegate onTimeout) {
+  CallbackHandle handle = registerTimeout(state, timeout, onTimeout, false);
+  
+  // Riserva lo spazio per la catena di stati con più timeout: setState() non alloca mai
+  if (handle != ESM_INVALID_HANDLE) reserveTimeouts();
+  return handle;
+}
+
+CallbackHandle EventStateMachine::addPeriodicTimeout(StateId state, unsigned long interval, StateDelegate onTimer) {
+  // Con periodo nullo il timer scatterebbe di continuo
+  if (interval == 0) return ESM_INVALID_HANDLE;
+  CallbackHandle handle = registerTimeout(state, interval, onTimer, true);
+  if (handle != ESM_INVALID_HANDLE) reserveTimeouts();
+  return handle;
+}
+
+CallbackHandle EventStateMachine::registerTimeout(StateId state, unsigned long duration, StateDelegate callback, bool periodic) {
+  if (frozen || !isValidState(state) || callback == nullptr) return ESM_INVALID_HANDLE;
+  
+  // Crea e aggiungi la struttura TimeoutInfo
+  TimeoutInfo timeoutInfo;
+  timeoutInfo.duration = duration;
+  timeoutInfo.callback = callback;
+  timeoutInfo.periodic = periodic;
+  
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return ESM_INVALID_HANDLE;
+  CallbackHandle handle = registerCallback(def->timeouts, CALLBACK_TIMEOUT, state, timeoutInfo);
+  if (handle == ESM_INVALID_HANDLE) return handle;
+  def->flags |= STATE_HAS_TIMEOUTS;
+#if ESM_PROFILING
+  resetProfileSlot(def->timeoutProfiles, handle);
+#endif
+  return handle;
+}
+
+CallbackHandle EventStateMachine::addOnEnter(StateId state, StateDelegate onEnter) {
+  if (frozen || !isValidState(state) || onEnter == nullptr) return ESM_INVALID_HANDLE;
+  
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return ESM_INVALID_HANDLE;
+  CallbackHandle handle = registerCallback(def->onEnters, CALLBACK_ENTER, state, onEnter);
+  if (handle == ESM_INVALID_HANDLE) return handle;
+  def->flags |= STATE_HAS_ENTERS;
+#if ESM_PROFILING
+  resetProfileSlot(def->enterProfiles, handle);
+#endif
+  return handle;
+}
+
+CallbackHandle EventStateMachine::addOnState(StateId state, StateFunctionDelegate onState) {
+  if (frozen || !isValidState(state) || onState == nullptr) return ESM_INVALID_HANDLE;
+  
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return ESM_INVALID_HANDLE;
+  CallbackHandle handle = registerCallback(def->onStates, CALLBACK_STATE, state, onState);
+  if (handle == ESM_INVALID_HANDLE) return handle;
+  def->flags |= STATE_HAS_STATES;
+#if ESM_PROFILING
+  resetProfileSlot(def->stateProfiles, handle);
+#endif
+  notifyScheduler();
+  return handle;
+}
+
+CallbackHandle EventStateMachine::addOnExit(StateId state, StateDelegate onExit) {
+  if (frozen || !isValidState(state) || onExit == nullptr) return ESM_INVALID_HANDLE;
+  
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return ESM_INVALID_HANDLE;
+  CallbackHandle handle = registerCallback(def->onExits, CALLBACK_EXIT, state, onExit);
+  if (handle == ESM_INVALID_HANDLE) return handle;
+  def->flags |= STATE_HAS_EXITS;
+#if ESM_PROFILING
+  resetProfileSlot(def->exitProfiles, handle);
+#endif
+  return handle;
+}
+
+bool EventStateMachine::setOnStateInterval(StateId state, unsigned long interval) {
+  if (!isValidState(state)) return false;
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return false;
+  def->onStateInterval = interval;
+  def->nextOnStateRun = esmClock();
+  notifyScheduler();
+  return true;
+}
+
+unsigned long EventStateMachine::getOnStateInterval(StateId state) const {
+  if (!isValidState(state)) return 0;
+  return states[state]->onStateInterval;
+}
+
+bool EventStateMachine::setStateTask(StateId state, StateTaskDelegate body) {
+  if (frozen || !isValidState(state)) return false;
+  
+  // Il corpo in esecuzione non può sostituire né rimuovere se stesso
+  StateTask* task = states[state]->task;
+  if (task != nullptr && task->running) return false;
+  if (task != nullptr) unschedulePendingTimeout(state, TASK_TIMEOUT_INDEX);
+  
+  if (body == nullptr) {
+    if (task == nullptr) return true;
+    destroyTask(*states[state]);
+    updateStateFlags(state);
+    return true;
+  }
+  
+  // Senza memoria lo stato resta senza corpo
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return false;
+  if (task == nullptr) {
+    void* memory = allocator->allocate(sizeof(StateTask), ESM_MEMORY_CONFIG);
+    if (memory == nullptr) return false;
+    task = new (memory) StateTask(state);
+    def->task = task;
+  }
+  task->body = body;
+  def->flags |= STATE_HAS_TASK;
+  reserveTimeouts();
+  
+  // Stato già attivo: il nuovo corpo parte dall'inizio al prossimo update()
+  task->finish();
+  if (def->visitGeneration != 0) {
+    task->status = TASK_READY;
+    notifyScheduler();
+  }
+  return true;
+}
+
+StateTaskStatus EventStateMachine::getStateTaskStatus(StateId state) const {
+  if (!isValidState(state) || states[state]->task == nullptr) return TASK_IDLE;
+  return states[state]->task->getStatus();
+}
+
+void EventStateMachine::destroyTask(StateDefinition& def) {
+  def.task->~StateTask();
+  allocator->deallocate(def.task, sizeof(StateTask), ESM_MEMORY_CONFIG);
+  def.task = nullptr;
+}
+
+void EventStateMachine::startTask(StateId state) {
+  StateTask& task = *states[state]->task;
+  task.finish();
+  task.expired = false;
+  task.payload = 0;
+  
+  // Rientro nello stato dal corpo stesso: riparte quando il corpo ritorna
+  if (task.running) {
+    task.restarted = true;
+    return;
+  }
+  resumeTask(state);
+}
+
+void EventStateMachine::cancelTask(StateId state) {
+  StateTask& task = *states[state]->task;
+  task.finish();
+  if (task.running) task.cancelled = true;
+}
+
+void EventStateMachine::resumeTask(StateId state) {
+  StateTask& task = *states[state]->task;
+  
+  // Un corpo che ritorna senza una nuova attesa è terminato
+  task.status = TASK_IDLE;
+  task.running = true;
+  task.cancelled = false;
+  task.restarted = false;
+  StateTaskDelegate body = task.body;
+  body(task);
+  task.running = false;
+  
+  // Il corpo ha cambiato stato: l'attesa richiesta non vale più
+  if (task.restarted || task.cancelled) {
+    task.finish();
+    if (task.restarted) {
+      task.status = TASK_READY;
+      notifyScheduler();
+    }
+    task.restarted = false;
+    task.cancelled = false;
+    return;
+  }
+  
+  if (task.status == TASK_READY) {
+    notifyScheduler();
+  } else if (task.status == TASK_WAIT_DELAY || (task.status == TASK_WAIT_EVENT && task.duration > 0)) {
+    EsmTime deadline = readClock() + esmMillisToTicks(task.duration);
+    pendingTimeouts.push_back({deadline, TASK_TIMEOUT_INDEX, state, states[state]->visitGeneration});
+    std::push_heap(pendingTimeouts.begin(), pendingTimeouts.end(), timeoutExpiresLater);
+    armTimeoutTicker();
+  }
+}
+
+bool EventStateMachine::deliverTaskEvent(uint8_t region, const StateEvent& event) {
+  // Solo il corpo più interno che attende l'evento lo riceve
+  for (StateId s = regions[region].current; s != ESM_NO_STATE; s = states[s]->parent) {
+    if (!(states[s]->flags & STATE_HAS_TASK)) continue;
+    StateTask& task = *states[s]->task;
+    if (task.status != TASK_WAIT_EVENT || task.awaitedEvent != event.eventId) continue;
+    
+    if (task.duration > 0) unschedulePendingTimeout(s, TASK_TIMEOUT_INDEX);
+    task.expired = false;
+    task.payload = event.payload;
+    resumeTask(s);
+    return true;
+  }
+  return false;
+}
+
+void EventStateMachine::resumeReadyTasks(uint8_t region) {
+  StateId path[ESM_MAX_STATE_DEPTH];
+  uint8_t depth = 0;
+  for (StateId s = regions[region].current; s != ESM_NO_STATE; s = states[s]->parent) {
+    if (states[s]->flags & STATE_HAS_TASK) path[depth++] = s;
+  }
+  
+  // Come gli onState: prima gli antenati; si ferma se un corpo cambia stato
+  uint16_t generation = stateGeneration;
+  while (depth > 0 && stateGeneration == generation) {
+    StateId s = path[--depth];
+    if (states[s]->task->status == TASK_READY) resumeTask(s);
+  }
+}
+
+bool EventStateMachine::hasReadyTasks() const {
+  for (uint8_t r = 0; r < regionCount; r++) {
+    for (StateId s = regions[r].current; s != ESM_NO_STATE; s = states[s]->parent) {
+      if ((states[s]->flags & STATE_HAS_TASK) && states[s]->task->status == TASK_READY) return true;
+    }
+  }
+  return false;
+}
+
+bool EventStateMachine::removeCallback(CallbackHandle handle) {
+  uint8_t index = handle & 0xFF;
+  StateId state = (StateId)(handle >> 8);
+  uint8_t kind = (handle >> HANDLE_KIND_SHIFT) & 0x07;
+  uint16_t generation = handle >> HANDLE_GENERATION_SHIFT;
+  
+  // Gli handler globali non fanno parte della tabella congelata
+  if (kind == CALLBACK_BEFORE) return beforeStateChangeHandlers.remove(index, generation);
+  if (kind == CALLBACK_AFTER) return afterStateChangeHandlers.remove(index, generation);
+  
+  if (frozen || !isValidState(state)) return false;
+  
+  StateDefinition& def = *states[state];
+  bool removed = false;
+  switch (kind) {
+    case CALLBACK_ENTER:
+      removed = def.onEnters.remove(index, generation);
+      break;
+    case CALLBACK_STATE:
+      removed = def.onStates.remove(index, generation);
+      break;
+    case CALLBACK_EXIT:
+      removed = def.onExits.remove(index, generation);
+      break;
+    case CALLBACK_TIMEOUT:
+      removed = def.timeouts.remove(index, generation);
+      // Assicurati di togliere la scadenza dalla coda se lo stato è attivo
+      if (removed && isInState(state)) {
+        unschedulePendingTimeout(state, index);
+      }
+      break;
+  }
+  if (removed) updateStateFlags(state);
+  return removed;
+}
+
+bool EventStateMachine::removeTimeout(StateId state, unsigned long timeout) {
+  if (frozen || !isValidState(state)) return false;
+  
+  auto& timeouts = states[state]->timeouts;
+  for (size_t i = 0; i < timeouts.size(); i++) {
+    if (timeouts.isActive(i) && timeouts[i].duration == timeout) {
+      return removeCallback(makeHandle(CALLBACK_TIMEOUT, state, i, timeouts.generationAt(i)));
+    }
+  }
+  return false;
+}
 
-// Funzione statica per il callback del Ticker
-void EventStateMachine::onTimeoutStatic(uint8_t state, uint8_t timeoutIndex) {
-  if (instance) {
-    instance->onTimeout(state, timeoutIndex);
-  }
+bool EventStateMachine::removeOnEnter(StateId state, StateDelegate onEnter) {
+  if (frozen || !isValidState(state)) return false;
+  if (removeFirst(states[state]->onEnters, onEnter) < 0) return false;
+  updateStateFlags(state);
+  return true;
 }
 
-void EventStateMachine::onTimeout(uint8_t state, uint8_t timeoutIndex) {
-  // Verifica che lo stato corrente sia quello per cui il timeout è stato impostato
-  if (currentState == state && timeoutIndex < states[state].timeouts.size()) {
-    if (debugEnabled) {
-      Serial.print("DEBUG: Timeout triggered for state ");
-      Serial.print(state);
-      Serial.print(", index ");
-      Serial.println(timeoutIndex);
-    }
-    
-    states[state].timeouts[timeoutIndex].callback(currentState, previousState);
-  }
+bool EventStateMachine::removeOnState(StateId state, StateFunctionDelegate onState) {
+  if (frozen || !isValidState(state)) return false;
+  if (removeFirst(states[state]->onStates, onState) < 0) return false;
+  updateStateFlags(state);
+  return true;
 }
 
-bool EventStateMachine::isValidState(uint8_t state) const {
-  return state < numStates;
+bool EventStateMachine::removeOnExit(StateId state, StateDelegate onExit) {
+  if (frozen || !isValidState(state)) return false;
+  if (removeFirst(states[state]->onExits, onExit) < 0) return false;
+  updateStateFlags(state);
+  return true;
 }
 
-EventStateMachine::EventStateMachine(uint8_t numberOfStates) {
-  numStates = numberOfStates;
-  states = new StateDefinition[numStates];
-  currentState = 0;
-  previousState = 0;
-  stateChanged = true;
-  stateEnteredTime = millis();
-  debugEnabled = false;
-  
-  // Imposta questa istanza come l'istanza globale
-  setInstance();
+CallbackHandle EventStateMachine::addBeforeStateChangeHandler(GlobalStateDelegate handler) {
+  if (handler == nullptr) return ESM_INVALID_HANDLE;
+  return registerCallback(beforeStateChangeHandlers, CALLBACK_BEFORE, 0, handler);
 }
 
-EventStateMachine::~EventStateMachine() {
-  // Ferma tutti i Ticker
-  for (uint8_t s = 0; s < numStates; s++) {
-    for (auto& timeoutInfo : states[s].timeouts) {
-      timeoutInfo.ticker.detach();
-    }
-  }
-  
-  delete[] states;
+CallbackHandle EventStateMachine::addAfterStateChangeHandler(GlobalStateDelegate handler) {
+  if (handler == nullptr) return ESM_INVALID_HANDLE;
+  return registerCallback(afterStateChangeHandlers, CALLBACK_AFTER, 0, handler);
 }
 
-void EventStateMachine::configureState(uint8_t state, unsigned long timeout,
-                  StateCallback onEnter,
-                  StateFunction onState,
-                  StateCallback onExit,
-                  StateCallback onTimeout) {
-  if (!isValidState(state)) return;
-  
-  // Aggiungi i callback se non sono nullptr
-  if (onEnter != nullptr) {
-    addOnEnter(state, onEnter);
+bool EventStateMachine::removeBeforeStateChangeHandler(GlobalStateDelegate handler) {
+  return removeFirst(beforeStateChangeHandlers, handler) >= 0;
+}
+
+bool EventStateMachine::removeAfterStateChangeHandler(GlobalStateDelegate handler) {
+  return removeFirst(afterStateChangeHandlers, handler) >= 0;
+}
+
+// Come per i callback di stato: indici e copia, sicuro rispetto alle rimozioni
+static void runGlobalHandlers(const CallbackList<GlobalStateDelegate>& handlers, StateId fromState, StateId toState) {
+  size_t count = handlers.size();
+  for (size_t i = 0; i < count; i++) {
+    if (!handlers.isActive(i)) continue;
+    GlobalStateDelegate handler = handlers[i];
+    handler(fromState, toState);
   }
+}
+
+bool EventStateMachine::addTransition(StateId state, uint8_t eventId, StateId targetState, TransitionGuard guard) {
+  if (!isValidState(state) || !isValidState(targetState)) return false;
   
-  if (onState != nullptr) {
-    addOnState(state, onState);
-  }
+  // Transizione morta: setState() la rifiuterebbe sempre
+  if (!isTransitionAllowed(state, targetState)) return false;
   
-  if (onExit != nullptr) {
-    addOnExit(state, onExit);
-  }
+  TransitionInfo transition;
+  transition.eventId = eventId;
+  transition.targetState = targetState;
+  transition.guard = guard;
   
-  if (timeout > 0 && onTimeout != nullptr) {
-    addTimeout(state, timeout, onTimeout);
-  }
+  StateDefinition* def = defineState(state);
+  if (def == nullptr) return false;
+  def->transitions.push_back(transition);
+  return true;
 }
 
-bool EventStateMachine::addTimeout(uint8_t state, unsigned long timeout, StateCallback onTimeout) {
-  if (!isValidState(state) || onTimeout == nullptr) return false;
-  
-  // Crea e aggiungi la struttura TimeoutInfo
-  TimeoutInfo timeoutInfo;
-  timeoutInfo.duration = timeout;
-  timeoutInfo.callback = onTimeout;
-  
-  states[state].timeouts.push_back(timeoutInfo);
+bool EventStateMachine::setAllowedTransitions(const uint8_t* matrix, StateId matrixStates) {
+  if (matrix != nullptr && matrixStates != numStates) return false;
+  allowedTransitions = matrix;
   return true;
 }
 
-bool EventStateMachine::addOnEnter(uint8_t state, StateCallback onEnter) {
-  if (!isValidState(state) || onEnter == nullptr) return false;
+bool EventStateMachine::isTransitionAllowed(StateId fromState, StateId toState) const {
+  if (allowedTransitions == nullptr) return true;
+  if (!isValidState(fromState) || !isValidState(toState)) return false;
   
-  states[state].onEnters.push_back(onEnter);
-  return true;
+  // Un bit per stato della catena: lo stato stesso e poi i suoi antenati
+  for (StateId s = fromState; s != ESM_NO_STATE; s = states[s]->parent) {
+    size_t bit = (size_t)s * numStates + toState;
+    if (allowedTransitions[bit >> 3] & (1 << (bit & 7))) return true;
+  }
+  return false;
 }
 
-bool EventStateMachine::addOnState(uint8_t state, StateFunction onState) {
-  if (!isValidState(state) || onState == nullptr) return false;
+bool EventStateMachine::enableStatistics() {
+  if (stateStatistics != nullptr) return true;
+  if (numStates == 0 || numStates > ESM_STATISTICS_MAX_STATES) return false;
   
-  states[state].onStates.push_back(onState);
+  stateStatistics = static_cast<StateStatistics*>(allocator->allocate(numStates * sizeof(StateStatistics), ESM_MEMORY_DISPATCH));
+  transitionPairs = static_cast<uint32_t*>(allocator->allocate((size_t)numStates * numStates * sizeof(uint32_t), ESM_MEMORY_DISPATCH));
+  if (stateStatistics == nullptr || transitionPairs == nullptr) {
+    allocator->deallocate(stateStatistics, numStates * sizeof(StateStatistics), ESM_MEMORY_DISPATCH);
+    allocator->deallocate(transitionPairs, (size_t)numStates * numStates * sizeof(uint32_t), ESM_MEMORY_DISPATCH);
+    stateStatistics = nullptr;
+    transitionPairs = nullptr;
+    return false;
+  }
+  resetStatistics();
   return true;
 }
 
-bool EventStateMachine::addOnExit(uint8_t state, StateCallback onExit) {
-  if (!isValidState(state) || onExit == nullptr) return false;
+void EventStateMachine::resetStatistics() {
+  if (stateStatistics == nullptr) return;
+  memset(stateStatistics, 0, numStates * sizeof(StateStatistics));
+  memset(transitionPairs, 0, (size_t)numStates * numStates * sizeof(uint32_t));
   
-  states[state].onExits.push_back(onExit);
-  return true;
+  // Le visite in corso vengono contate da adesso
+  EsmTime now = esmClock();
+  for (uint8_t r = 0; r < regionCount; r++) {
+    regions[r].statisticsVisitStart = now;
+  }
 }
 
-bool EventStateMachine::removeTimeout(uint8_t state, unsigned long timeout) {
+const StateStatistics* EventStateMachine::getStateStatistics(StateId state) const {
+  if (stateStatistics == nullptr || !isValidState(state)) return nullptr;
+  return &stateStatistics[state];
+}
+
+uint32_t EventStateMachine::getTransitionPairCount(StateId fromState, StateId toState) const {
+  if (transitionPairs == nullptr || !isValidState(fromState) || !isValidState(toState)) return 0;
+  return transitionPairs[(size_t)fromState * numStates + toState];
+}
+
+bool EventStateMachine::removeTransition(StateId state, uint8_t eventId) {
   if (!isValidState(state)) return false;
   
-  auto& timeouts = states[state].timeouts;
-  for (auto it = timeouts.begin(); it != timeouts.end(); ++it) {
-    if (it->duration == timeout) {
-      it->ticker.detach(); // Assicurati di fermare il ticker
-      timeouts.erase(it);
+  auto& transitions = states[state]->transitions;
+  for (auto it = transitions.begin(); it != transitions.end(); ++it) {
+    if (it->eventId == eventId) {
+      transitions.erase(it);
       return true;
     }
   }
   return false;
 }
 
-bool EventStateMachine::removeOnEnter(uint8_t state, StateCallback onEnter) {
-  if (!isValidState(state)) return false;
+// Copia una riga della tabella, dalla RAM o dalla flash
+template <typename T>
+static void readRow(T& row, const T* source, bool progmem) {
+  if (progmem) {
+    memcpy_P(&row, source, sizeof(T));
+  } else {
+    row = *source;
+  }
+}
+
+// Conteggio saturato a 255, il numero massimo di voci di una lista
+static void countRow(uint8_t& counter) {
+  if (counter < ESM_MAX_LIST_SLOTS) counter++;
+}
+
+void EventStateMachine::defineStates(const uint8_t* counts, size_t stride) {
+  StateId missing = 0;
+  for (StateId s = 0; s < numStates; s++) {
+    if (counts[s * stride] > 0 && states[s] == &emptyState) missing++;
+  }
+  if (missing == 0) return;
   
-  auto& callbacks = states[state].onEnters;
-  for (auto it = callbacks.begin(); it != callbacks.end(); ++it) {
-    if (*it == onEnter) {
-      callbacks.erase(it);
-      return true;
+  // Un solo blocco per tutte le definizioni nuove, solo al primo caricamento:
+  // i successivi tornano all'allocazione per stato di defineState()
+  if (definitionBlock == nullptr) {
+    definitionBlock = static_cast<StateDefinition*>(allocator->allocate(missing * sizeof(StateDefinition), ESM_MEMORY_CONFIG));
+    if (definitionBlock != nullptr) {
+      definitionBlockSize = missing;
+      StateId next = 0;
+      for (StateId s = 0; s < numStates; s++) {
+        if (counts[s * stride] > 0 && states[s] == &emptyState) states[s] = new (&definitionBlock[next++]) StateDefinition(allocator);
+      }
+      return;
     }
   }
-  return false;
+  
+  // Gli stati che non ricevono memoria restano su emptyState e le loro righe
+  // vengono rifiutate dalla registrazione
+  for (StateId s = 0; s < numStates; s++) {
+    if (counts[s * stride] > 0) defineState(s);
+  }
 }
 
-bool EventStateMachine::removeOnState(uint8_t state, StateFunction onState) {
-  if (!isValidState(state)) return false;
+// Conteggi per stato di loadStateTable(): righe, onEnter, onState, onExit, timeout
+enum StateRowCount : uint8_t {
+  COUNT_ROWS = 0,
+  COUNT_ENTER,
+  COUNT_STATE,
+  COUNT_EXIT,
+  COUNT_TIMEOUT,
+  COUNT_KINDS
+};
+
+bool EventStateMachine::loadStateTable(const StateConfig* table, size_t count, bool progmem) {
+  if (frozen || table == nullptr || numStates == 0) return false;
   
-  auto& callbacks = states[state].onStates;
-  for (auto it = callbacks.begin(); it != callbacks.end(); ++it) {
-    if (*it == onState) {
-      callbacks.erase(it);
-      return true;
+  // Primo passaggio: quante voci riceve ogni lista. Buffer temporaneo preso
+  // dall'allocatore della macchina e restituito alla fine
+  size_t countsSize = (size_t)numStates * COUNT_KINDS;
+  uint8_t* counts = static_cast<uint8_t*>(allocator->allocate(countsSize, ESM_MEMORY_CONFIG));
+  if (counts == nullptr) return false;
+  memset(counts, 0, countsSize);
+  StateConfig row;
+  for (size_t i = 0; i < count; i++) {
+    readRow(row, &table[i], progmem);
+    if (!isValidState(row.state)) continue;
+    uint8_t* stateCounts = &counts[(size_t)row.state * COUNT_KINDS];
+    countRow(stateCounts[COUNT_ROWS]);
+    if (row.onEnter != nullptr) countRow(stateCounts[COUNT_ENTER]);
+    if (row.onState != nullptr) countRow(stateCounts[COUNT_STATE]);
+    if (row.onExit != nullptr) countRow(stateCounts[COUNT_EXIT]);
+    if (row.timeout > 0 && row.onTimeout != nullptr) countRow(stateCounts[COUNT_TIMEOUT]);
+  }
+  
+  // Definizioni e liste dimensionate una sola volta
+  defineStates(counts, COUNT_KINDS);
+  for (StateId s = 0; s < numStates; s++) {
+    const uint8_t* stateCounts = &counts[(size_t)s * COUNT_KINDS];
+    if (stateCounts[COUNT_ROWS] == 0 || states[s] == &emptyState) continue;
+    
+    StateDefinition& def = *states[s];
+    def.onEnters.reserve(def.onEnters.size() + stateCounts[COUNT_ENTER]);
+    def.onStates.reserve(def.onStates.size() + stateCounts[COUNT_STATE]);
+    def.onExits.reserve(def.onExits.size() + stateCounts[COUNT_EXIT]);
+    def.timeouts.reserve(def.timeouts.size() + stateCounts[COUNT_TIMEOUT]);
+#if ESM_PROFILING
+    def.enterProfiles.reserve(def.onEnters.size() + stateCounts[COUNT_ENTER]);
+    def.stateProfiles.reserve(def.onStates.size() + stateCounts[COUNT_STATE]);
+    def.exitProfiles.reserve(def.onExits.size() + stateCounts[COUNT_EXIT]);
+    def.timeoutProfiles.reserve(def.timeouts.size() + stateCounts[COUNT_TIMEOUT]);
+#endif
+  }
+  allocator->deallocate(counts, countsSize, ESM_MEMORY_CONFIG);
+  
+  // Secondo passaggio: registrazione, senza altre allocazioni
+  bool valid = true;
+  for (size_t i = 0; i < count; i++) {
+    readRow(row, &table[i], progmem);
+    if (!isValidState(row.state)) {
+      valid = false;
+      continue;
     }
+    
+    if (row.onEnter != nullptr && addOnEnter(row.state, row.onEnter) == ESM_INVALID_HANDLE) valid = false;
+    if (row.onState != nullptr && addOnState(row.state, row.onState) == ESM_INVALID_HANDLE) valid = false;
+    if (row.onExit != nullptr && addOnExit(row.state, row.onExit) == ESM_INVALID_HANDLE) valid = false;
+    if (row.timeout > 0 && row.onTimeout != nullptr &&
+        registerTimeout(row.state, row.timeout, row.onTimeout, false) == ESM_INVALID_HANDLE) valid = false;
+    if (row.parent != ESM_NO_STATE && !assignParent(row.state, row.parent)) valid = false;
   }
-  return false;
+  
+  // Coda dei timeout dimensionata una volta per tutta la tabella
+  reserveTimeouts();
+  return valid;
 }
 
-bool EventStateMachine::removeOnExit(uint8_t state, StateCallback onExit) {
-  if (!isValidState(state)) return false;
+bool EventStateMachine::loadTransitionTable(const TransitionConfig* table, size_t count, bool progmem) {
+  if (table == nullptr || numStates == 0) return false;
   
-  auto& callbacks = states[state].onExits;
-  for (auto it = callbacks.begin(); it != callbacks.end(); ++it) {
-    if (*it == onExit) {
-      callbacks.erase(it);
-      return true;
-    }
+  uint8_t* counts = static_cast<uint8_t*>(allocator->allocate(numStates, ESM_MEMORY_CONFIG));
+  if (counts == nullptr) return false;
+  memset(counts, 0, numStates);
+  TransitionConfig row;
+  for (size_t i = 0; i < count; i++) {
+    readRow(row, &table[i], progmem);
+    if (isValidState(row.state) && isValidState(row.targetState)) countRow(counts[row.state]);
   }
-  return false;
+  
+  defineStates(counts, 1);
+  for (StateId s = 0; s < numStates; s++) {
+    if (counts[s] > 0 && states[s] != &emptyState) states[s]->transitions.reserve(states[s]->transitions.size() + counts[s]);
+  }
+  allocator->deallocate(counts, numStates, ESM_MEMORY_CONFIG);
+  
+  bool valid = true;
+  for (size_t i = 0; i < count; i++) {
+    readRow(row, &table[i], progmem);
+    if (!addTransition(row.state, row.eventId, row.targetState, row.guard)) valid = false;
+  }
+  return valid;
+}
+
+bool EventStateMachine::loadStates(const StateConfig* table, size_t count) {
+  return loadStateTable(table, count, false);
+}
+
+bool EventStateMachine::loadStates_P(const StateConfig* table, size_t count) {
+  return loadStateTable(table, count, true);
+}
+
+bool EventStateMachine::loadTransitions(const TransitionConfig* table, size_t count) {
+  return loadTransitionTable(table, count, false);
+}
+
+bool EventStateMachine::loadTransitions_P(const TransitionConfig* table, size_t count) {
+  return loadTransitionTable(table, count, true);
+}
+
+bool EventStateMachine::postEvent(uint8_t eventId, uint32_t payload) {
+#if ESM_THREAD_SAFE
+  if (!isOwnerContext()) {
+    return marshalRequest(true, eventId, payload);
+  }
+#endif
+  
+  StateEvent event;
+  event.eventId = eventId;
+  event.payload = payload;
+  
+  if (!events.push(event)) {
+    ESM_TRACE(TRACE_EVENT_DROPPED, currentState, eventId, payload);
+    return false;
+  }
+  
+  ESM_TRACE(TRACE_EVENT_POSTED, currentState, eventId, payload);
+  notifyScheduler();
+  return true;
 }
 
-void EventStateMachine::addBeforeStateChangeHandler(GlobalStateCallback handler) {
-  if (handler != nullptr) {
-    beforeStateChangeHandlers.push_back(handler);
+void EventStateMachine::processEvents() {
+  StateEvent event;
+  
+  // Ogni evento viene completato (transizione inclusa) prima di passare al successivo
+  for (uint8_t processed = 0; processed < maxEventsPerUpdate && events.pop(event); processed++) {
+    ESM_TRACE(TRACE_EVENT_DISPATCHED, currentState, event.eventId, event.payload);
+    
+    // L'evento viene offerto a ogni regione: prima ai corpi di stato che lo
+    // attendono, che lo consumano; quelli non gestiti dallo stato corrente
+    // passano agli stati padre
+    for (uint8_t r = 0; r < regionCount; r++) {
+      if (deliverTaskEvent(r, event)) continue;
+      for (StateId s = regions[r].current; s != ESM_NO_STATE; s = states[s]->parent) {
+        const TransitionInfo* transition = findTransition(s, event);
+        if (transition != nullptr) {
+          activeCause = TRANSITION_EVENT;
+          activeDetail = event.eventId;
+          setState(transition->targetState);
+          activeCause = TRANSITION_DIRECT;
+          activeDetail = 0;
+          break;
+        }
+      }
+    }
   }
 }
 
-void EventStateMachine::addAfterStateChangeHandler(GlobalStateCallback handler) {
-  if (handler != nullptr) {
-    afterStateChangeHandlers.push_back(handler);
+const TransitionInfo* EventStateMachine::findTransition(StateId state, const StateEvent& event) const {
+  for (const auto& transition : states[state]->transitions) {
+    if (transition.eventId != event.eventId) continue;
+    if (transition.guard != nullptr && !transition.guard(state, event.eventId, event.payload)) continue;
+    return &transition;
   }
+  return nullptr;
 }
 
-bool EventStateMachine::removeBeforeStateChangeHandler(GlobalStateCallback handler) {
-  for (auto it = beforeStateChangeHandlers.begin(); it != beforeStateChangeHandlers.end(); ++it) {
-    if (*it == handler) {
-      beforeStateChangeHandlers.erase(it);
-      return true;
+void EventStateMachine::setState(StateId newState) {
+  if (!isValidState(newState)) return;
+  
+#if ESM_THREAD_SAFE
+  // Chiamato da un altro task: la transizione viene eseguita dal task proprietario
+  if (!isOwnerContext()) {
+    marshalRequest(false, newState, 0);
+    return;
+  }
+#endif
+  
+  // Chiamato da un callback della transizione in corso: viene eseguito subito dopo
+  if (inTransition) {
+    // Una sola richiesta in sospeso: vince l'ultima, quella sostituita viene contata
+    if (hasPendingState) {
+      droppedStateRequests++;
+      ESM_TRACE(TRACE_STATE_REQUEST_DROPPED, pendingState, 0, newState);
     }
+    pendingState = newState;
+    pendingCause = activeCause;
+    pendingDetail = activeDetail;
+    hasPendingState = true;
+    return;
   }
-  return false;
+  
+  inTransition = true;
+  performTransition(newState, activeCause, activeDetail);
+  while (hasPendingState) {
+    hasPendingState = false;
+    performTransition(pendingState, pendingCause, pendingDetail);
+  }
+  inTransition = false;
+  notifyScheduler();
 }
 
-bool EventStateMachine::removeAfterStateChangeHandler(GlobalStateCallback handler) {
-  for (auto it = afterStateChangeHandlers.begin(); it != afterStateChangeHandlers.end(); ++it) {
-    if (*it == handler) {
-      afterStateChangeHandlers.erase(it);
-      return true;
+#if ESM_HISTORY_SIZE > 0
+void EventStateMachine::recordHistory(StateId fromState, StateId toState, uint8_t cause, uint8_t detail) {
+  // Scrittore unico (il contesto che esegue le transizioni): numero dispari durante
+  // la scrittura, così un lettore concorrente sa di dover ripetere la copia
+  uint32_t sequence = historySequence.load(std::memory_order_relaxed);
+  historySequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  
+  TransitionHistoryEntry& entry = history[(sequence / 2) % ESM_HISTORY_SIZE];
+  entry.timestamp = (uint32_t)esmTicksToMillis(clockTime);
+  entry.fromState = fromState;
+  entry.toState = toState;
+  entry.cause = cause;
+  entry.detail = detail;
+  
+  historySequence.store(sequence + 2, std::memory_order_release);
+}
+#endif
+
+size_t EventStateMachine::getHistory(TransitionHistoryEntry* entries, size_t maxEntries) const {
+#if ESM_HISTORY_SIZE > 0
+  if (entries == nullptr) return 0;
+  
+  for (;;) {
+    uint32_t sequence = historySequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+#if defined(ESP32) && !defined(ESM_HOST)
+      // Scrittura in corso: un lettore con priorità più alta lascia finire lo scrittore
+      vTaskDelay(1);
+#endif
+      continue;
+    }
+    
+    uint32_t written = sequence / 2;
+    size_t count = written < ESM_HISTORY_SIZE ? written : ESM_HISTORY_SIZE;
+    if (count > maxEntries) count = maxEntries;
+    
+    uint32_t first = written - count;
+    for (size_t i = 0; i < count; i++) {
+      entries[i] = history[(first + i) % ESM_HISTORY_SIZE];
     }
+    
+    // Copia valida solo se nessuna voce è stata scritta nel frattempo
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (historySequence.load(std::memory_order_relaxed) == sequence) return count;
   }
-  return false;
+#else
+  (void)entries;
+  (void)maxEntries;
+  return 0;
+#endif
 }
 
-void EventStateMachine::setState(uint8_t newState) {
-  if (!isValidState(newState)) return;
+uint32_t EventStateMachine::getTransitionCount() const {
+#if ESM_HISTORY_SIZE > 0
+  return historySequence.load(std::memory_order_acquire) / 2;
+#else
+  return 0;
+#endif
+}
+
+void EventStateMachine::performTransition(StateId newState, uint8_t cause, uint8_t detail) {
+  // La transizione avviene nella regione dello stato di arrivo
+  uint8_t region = regionOf(newState);
+  RegionState& active = regions[region];
+  StateId fromState = active.current;
   
   // Non fare nulla se lo stato non cambia
-  if (newState == currentState) return;
+  if (newState == fromState) return;
+  
+  if (allowedTransitions != nullptr && !isTransitionAllowed(fromState, newState)) {
+    rejectedTransitions++;
+    ESM_TRACE(TRACE_TRANSITION_REJECTED, fromState, 0, newState);
+    return;
+  }
+  
+  // Gli antenati comuni restano attivi: i loro callback e timeout non vengono toccati
+  StateId ancestor = commonAncestor(fromState, newState);
+  
+#if ESM_PROFILING
+  uint32_t transitionStart = ESM_PROFILE_CLOCK();
+  states[fromState]->profile.timeInState += esmTicksToMillis(readClock() - active.profileStart);
+#endif
   
   // Esegui tutti gli handler globali prima del cambio di stato
-  for (const auto& handler : beforeStateChangeHandlers) {
-    handler(currentState, newState);
+  if (beforeStateChangeHandlers.count() > 0) {
+    runGlobalHandlers(beforeStateChangeHandlers, fromState, newState);
   }
   
-  // Ferma tutti i ticker attivi dello stato corrente
-  for (auto& timeoutInfo : states[currentState].timeouts) {
-    timeoutInfo.ticker.detach();
+  // Esci dallo stato corrente risalendo fino all'antenato comune (escluso);
+  // i flag evitano di scorrere le liste vuote
+  for (StateId s = fromState; s != ancestor; s = states[s]->parent) {
+    if (states[s] == &emptyState) continue;
+    if (states[s]->flags & (STATE_HAS_TIMEOUTS | STATE_HAS_TASK)) cancelTimeouts(s);
+    if (states[s]->flags & STATE_HAS_TASK) cancelTask(s);
+    states[s]->visitGeneration = 0;
+    if (states[s]->flags & STATE_HAS_EXITS) runOnExits(s, newState);
   }
   
-  // Esegui tutti i callback di uscita
-  for (const auto& onExit : states[currentState].onExits) {
-    onExit(currentState, newState);
+  // Una sola lettura dell'orologio per statistiche, ingresso e timeout del nuovo stato
+  EsmTime now = readClock();
+  
+  // Contatori di esercizio: solo incrementi, nessuna ricerca
+  if (stateStatistics != nullptr) {
+    stateStatistics[fromState].timeInState += esmTicksToMillis(now - active.statisticsVisitStart);
+    active.statisticsVisitStart = now;
+    stateStatistics[newState].entries++;
+    transitionPairs[(size_t)fromState * numStates + newState]++;
   }
   
-  previousState = currentState;
-  currentState = newState;
-  stateEnteredTime = millis();
+  active.previous = fromState;
+  active.current = newState;
+  active.enteredTime = now;
+  if (region == 0) {
+    previousState = fromState;
+    currentState = newState;
+    stateEnteredTime = active.enteredTime;
+  }
   stateChanged = true;
+  // 0 indica uno stato non attivo: viene saltato al rollover
+  if (++stateGeneration == 0) stateGeneration = 1;
   
-  // Esegui tutti i callback di entrata
-  for (const auto& onEnter : states[currentState].onEnters) {
-    onEnter(currentState, previousState);
-  }
+  ESM_TRACE(TRACE_STATE_CHANGE, fromState, 0, newState);
   
-  // Imposta i nuovi timeout
-  for (size_t i = 0; i < states[currentState].timeouts.size(); i++) {
-    auto& timeoutInfo = states[currentState].timeouts[i];
-    
-    // Usa la funzione statica come callback, passando stato e indice
-    timeoutInfo.ticker.once_ms(timeoutInfo.duration, 
-      [state = currentState, index = i]() {
-        EventStateMachine::onTimeoutStatic(state, index);
-      }
-    );
-    
-    if (debugEnabled) {
-      Serial.print("DEBUG: Timeout set for state ");
-      Serial.print(currentState);
-      Serial.print(", index ");
-      Serial.print(i);
-      Serial.print(", duration ");
-      Serial.print(timeoutInfo.duration);
-      Serial.println(" ms");
-    }
+#if ESM_HISTORY_SIZE > 0
+  recordHistory(fromState, newState, cause, detail);
+#else
+  (void)cause;
+  (void)detail;
+#endif
+  
+#if ESM_HAS_FS
+  // Solo un push nel ring in RAM, la scrittura su flash avviene in update().
+  // Il log conserva lo stato della regione principale
+  if (persistence != nullptr && region == 0) {
+    persistence->record(fromState, newState);
   }
+#endif
+  
+  enterStates(newState, ancestor, fromState, now);
+  
+  // Arma il Ticker condiviso sulla scadenza più vicina
+  armTimeoutTicker();
   
   // Esegui tutti gli handler globali dopo il cambio di stato
-  for (const auto& handler : afterStateChangeHandlers) {
-    handler(previousState, currentState);
+  if (afterStateChangeHandlers.count() > 0) {
+    runGlobalHandlers(afterStateChangeHandlers, fromState, newState);
+  }
+  
+#if ESM_PROFILING
+  active.profileStart = now;
+  states[newState]->profile.entries++;
+  states[newState]->profile.transitions.record(ESM_PROFILE_CLOCK() - transitionStart);
+#endif
+}
+
+void EventStateMachine::enterStates(StateId state, StateId ancestor, StateId fromState, EsmTime enteredTime) {
+  // Entra negli stati dall'antenato comune (escluso) fino a 'state',
+  // accodando i timeout di ciascuno
+  StateId path[ESM_MAX_STATE_DEPTH];
+  uint8_t depth = 0;
+  for (StateId s = state; s != ancestor; s = states[s]->parent) {
+    path[depth++] = s;
+  }
+  while (depth > 0) {
+    StateId s = path[--depth];
+    if (states[s] == &emptyState) continue;
+    states[s]->visitGeneration = stateGeneration;
+    if (states[s]->onStateInterval > 0) states[s]->nextOnStateRun = enteredTime;
+    if (states[s]->flags & STATE_HAS_ENTERS) runOnEnters(s, fromState);
+    if (states[s]->flags & STATE_HAS_TIMEOUTS) scheduleTimeouts(s, enteredTime);
+    if (states[s]->flags & STATE_HAS_TASK) startTask(s);
+  }
+}
+
+uint8_t EventStateMachine::regionOf(StateId state) const {
+  if (regionCount == 1) return 0;
+  
+  while (states[state]->parent != ESM_NO_STATE) {
+    state = states[state]->parent;
+  }
+  return states[state]->region;
+}
+
+uint8_t EventStateMachine::addRegion(StateId initialState) {
+  if (frozen || regionCount >= ESM_MAX_REGIONS || !isValidState(initialState)) return ESM_NO_REGION;
+  
+  // La radice non deve essere attiva nella regione a cui appartiene ora
+  StateId root = initialState;
+  while (states[root]->parent != ESM_NO_STATE) {
+    root = states[root]->parent;
+  }
+  if (isInState(root)) return ESM_NO_REGION;
+  
+  StateDefinition* rootDefinition = defineState(root);
+  if (rootDefinition == nullptr) return ESM_NO_REGION;
+  
+  uint8_t region = regionCount;
+  EsmTime now = readClock();
+  RegionState& added = regions[region];
+  added.current = initialState;
+  added.previous = ESM_NO_STATE;
+  added.enteredTime = now;
+  added.statisticsVisitStart = now;
+#if ESM_PROFILING
+  added.profileStart = now;
+#endif
+  rootDefinition->region = region;
+  regionCount++;
+  reserveTimeouts();
+  
+  enterStates(initialState, ESM_NO_STATE, ESM_NO_STATE, now);
+  armTimeoutTicker();
+  return region;
+}
+
+bool EventStateMachine::setRegion(StateId state, uint8_t region) {
+  if (frozen || !isValidState(state) || region >= regionCount) return false;
+  if (states[state]->parent != ESM_NO_STATE || isInState(state)) return false;
+  
+  if (states[state]->region != region) {
+    StateDefinition* def = defineState(state);
+    if (def == nullptr) return false;
+    def->region = region;
+    reserveTimeouts();
+  }
+  return true;
+}
+
+uint8_t EventStateMachine::getRegion(StateId state) const {
+  if (!isValidState(state)) return ESM_NO_REGION;
+  return regionOf(state);
+}
+
+#if ESM_THREAD_SAFE
+bool EventStateMachine::isOwnerContext() const {
+#if defined(ESP32)
+  return ownerTask == nullptr || xTaskGetCurrentTaskHandle() == ownerTask;
+#else
+  // ESP8266: un solo contesto di esecuzione
+  return true;
+#endif
+}
+
+#if defined(ESP32)
+void EventStateMachine::setOwnerTask(TaskHandle_t task) {
+  ownerTask = task != nullptr ? task : xTaskGetCurrentTaskHandle();
+}
+#endif
+
+bool EventStateMachine::marshalRequest(bool isEvent, StateId value, uint32_t payload) {
+  StateRequest request;
+  request.isEvent = isEvent;
+  request.value = value;
+  request.payload = payload;
+  
+#if defined(ESP32)
+  uint32_t start = ESP.getCycleCount();
+  portENTER_CRITICAL(&requestLock);
+  uint32_t waited = ESP.getCycleCount() - start;
+  concurrencyStats.lockWaitCycles += waited;
+  if (waited > concurrencyStats.maxLockWaitCycles) {
+    concurrencyStats.maxLockWaitCycles = waited;
+  }
+#endif
+  
+  bool queued = requests.push(request);
+  if (queued) {
+    concurrencyStats.marshalledRequests++;
+  } else {
+    concurrencyStats.droppedRequests++;
+  }
+  
+#if defined(ESP32)
+  portEXIT_CRITICAL(&requestLock);
+#endif
+  
+  // Contesto di un altro task: la notifica allo scheduler non viene mai scartata
+  if (queued && scheduler != nullptr) {
+    scheduler->wake(*this);
   }
+  return queued;
 }
 
+void EventStateMachine::processRequests() {
+  StateRequest request;
+  while (requests.pop(request)) {
+    if (request.isEvent) {
+      postEvent(request.value, request.payload);
+    } else {
+      setState(request.value);
+    }
+  }
+}
+
+ConcurrencyStats EventStateMachine::getConcurrencyStats() {
+#if defined(ESP32)
+  portENTER_CRITICAL(&requestLock);
+#endif
+  ConcurrencyStats stats = concurrencyStats;
+#if defined(ESP32)
+  portEXIT_CRITICAL(&requestLock);
+#endif
+  return stats;
+}
+
+void EventStateMachine::resetConcurrencyStats() {
+#if defined(ESP32)
+  portENTER_CRITICAL(&requestLock);
+#endif
+  concurrencyStats = ConcurrencyStats();
+#if defined(ESP32)
+  portEXIT_CRITICAL(&requestLock);
+#endif
+}
+#endif // ESM_THREAD_SAFE
+
 void EventStateMachine::update() {
-  // Esegui tutte le funzioni di stato
-  for (const auto& onState : states[currentState].onStates) {
-    onState(currentState);
+#if ESM_THREAD_SAFE
+#if defined(ESP32)
+  if (ownerTask == nullptr) {
+    ownerTask = xTaskGetCurrentTaskHandle();
+  }
+#endif
+  
+  // Percorso veloce: senza richieste pendenti basta una lettura atomica
+  if (!requests.empty()) {
+    processRequests();
+  }
+#endif
+  
+  // Esegui i timeout scaduti accodati dal Ticker
+  if (deferredTimeouts) {
+    processDeferredTimeouts();
+  }
+  
+  // Elabora gli eventi in coda, al massimo maxEventsPerUpdate per ciclo
+  if (!events.empty()) {
+    processEvents();
+  }
+  
+  // Esegui tutte le funzioni di stato di ogni regione, comprese quelle degli stati padre.
+  // Una lettura dell'orologio per passaggio: intervalli degli onState e getTime()
+  readClock();
+  for (uint8_t r = 0; r < regionCount; r++) {
+    resumeReadyTasks(r);
+    StateId state = regions[r].current;
+    ESM_PROFILED(states[state]->profile.updates, runActiveStates(state));
   }
   
+#if ESM_TRACE_LEVEL > 0
+  // Formatta pochi eventi per ciclo: update() resta breve anche con il debug attivo
+  if (traceOutput != nullptr && !traceEvents.empty()) {
+    printTrace(*traceOutput, ESM_TRACE_PRINT_PER_UPDATE);
+  }
+#endif
+  
+#if ESM_HAS_FS
+  // Flush a blocchi del log persistente
+  if (persistence != nullptr) {
+    persistence->update();
+  }
+#endif
+  
   stateChanged = false;
 }
 
-uint8_t EventStateMachine::getCurrentState() const {
+bool EventStateMachine::getNextDeadline(EsmTime& deadline) const {
+  if (pendingTimeouts.empty()) return false;
+  deadline = pendingTimeouts.front().deadline;
+  return true;
+}
+
+unsigned long EventStateMachine::getTimeToNextTimeout() const {
+  EsmTime deadline;
+  if (!getNextDeadline(deadline)) return ESM_NO_TIMEOUT;
+  
+  EsmTime now = esmClock();
+  return deadline > now ? esmTicksToDelay(deadline - now) : 0;
+}
+
+bool EventStateMachine::hasOnStateCallbacks() const {
+  // I flag restano validi anche nella modalità congelata, che non ammette rimozioni
+  for (uint8_t r = 0; r < regionCount; r++) {
+    for (StateId s = regions[r].current; s != ESM_NO_STATE; s = states[s]->parent) {
+      if (states[s]->flags & STATE_HAS_STATES) return true;
+    }
+  }
+  return false;
+}
+
+bool EventStateMachine::hasPendingWork() const {
+  if (!events.empty() || !timeoutEvents.empty() || timeoutEventsOverflow) return true;
+#if ESM_THREAD_SAFE
+  if (!requests.empty()) return true;
+#endif
+#if ESM_TRACE_LEVEL > 0
+  if (traceOutput != nullptr && !traceEvents.empty()) return true;
+#endif
+#if ESM_HAS_FS
+  if (persistence != nullptr && persistence->getPendingRecords() > 0) return true;
+#endif
+  return hasReadyTasks();
+}
+
+bool EventStateMachine::isIdle() const {
+  if (hasPendingWork()) return false;
+  
+  // Un onState con intervallo è una scadenza come i timeout: inattiva fino ad allora
+  EsmTime wakeup;
+  return !getNextWakeup(wakeup) || wakeup > esmClock();
+}
+
+bool EventStateMachine::getNextWakeup(EsmTime& wakeup) const {
+  bool found = getNextDeadline(wakeup);
+  
+  // onState senza intervallo: da eseguire a ogni passaggio, quindi subito
+  for (uint8_t r = 0; r < regionCount; r++) {
+    for (StateId s = regions[r].current; s != ESM_NO_STATE; s = states[s]->parent) {
+      const StateDefinition& def = *states[s];
+      if (!(def.flags & STATE_HAS_STATES)) continue;
+      EsmTime due = def.onStateInterval > 0 ? def.nextOnStateRun : esmClock();
+      if (!found || due < wakeup) wakeup = due;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void EventStateMachine::notifyScheduler() {
+  if (scheduler != nullptr) {
+    scheduler->notify(*this);
+  }
+}
+
+unsigned long EventStateMachine::sleepUntilNextTimeout(unsigned long maxSleep) {
+  if (!isIdle()) return 0;
+  
+  // Fino al più vicino tra timeout e onState con intervallo. Senza scadenze né
+  // limite non esiste un risveglio garantito: non dorme
+  unsigned long sleepTime = maxSleep;
+  EsmTime start = esmClock();
+  EsmTime wakeup;
+  if (getNextWakeup(wakeup)) {
+    unsigned long untilWakeup = wakeup > start ? esmTicksToDelay(wakeup - start) : 0;
+    if (untilWakeup < sleepTime) sleepTime = untilWakeup;
+  }
+  if (sleepTime == 0 || sleepTime == ESM_NO_TIMEOUT) return 0;
+  
+  // Con i cicli al più mezzo giro del contatore, poi l'orologio va riletto
+  if (sleepTime > ESM_CLOCK_MAX_DELAY_MS) sleepTime = ESM_CLOCK_MAX_DELAY_MS;
+  
+#if defined(ESP32) && !defined(ESM_HOST)
+  // Il Ticker (esp_timer) viene recuperato al risveglio e scatta subito dopo
+  esp_sleep_enable_timer_wakeup((uint64_t)sleepTime * 1000);
+  esp_light_sleep_start();
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+#else
+  // ESP8266: delay() lascia entrare l'SDK in light sleep automatico se abilitato
+  // con WiFi.setSleepMode(WIFI_LIGHT_SLEEP). Sull'host avanza il tempo virtuale
+  delay(sleepTime);
+#endif
+  return esmTicksToMillis(esmClock() - start);
+}
+
+StateId EventStateMachine::getCurrentState() const {
   return currentState;
 }
 
-uint8_t EventStateMachine::getPreviousState() const {
+StateId EventStateMachine::getPreviousState() const {
   return previousState;
 }
 
@@ -283,7 +2018,120 @@ bool EventStateMachine::isStateChanged() const {
 }
 
 unsigned long EventStateMachine::timeInCurrentState() const {
-  return millis() - stateEnteredTime;
+  return esmTicksToMillis(esmClock() - stateEnteredTime);
+}
+
+StateId EventStateMachine::getCurrentState(uint8_t region) const {
+  return region < regionCount ? regions[region].current : ESM_NO_STATE;
+}
+
+StateId EventStateMachine::getPreviousState(uint8_t region) const {
+  return region < regionCount ? regions[region].previous : ESM_NO_STATE;
+}
+
+unsigned long EventStateMachine::timeInCurrentState(uint8_t region) const {
+  return region < regionCount ? esmTicksToMillis(esmClock() - regions[region].enteredTime) : 0;
+}
+
+uint64_t EventStateMachine::timeInCurrentStateMicros() const {
+  return esmTicksToMicros(esmClock() - stateEnteredTime);
+}
+
+uint64_t EventStateMachine::timeInCurrentStateMicros(uint8_t region) const {
+  return region < regionCount ? esmTicksToMicros(esmClock() - regions[region].enteredTime) : 0;
+}
+
+#if ESM_PROFILING
+const StateProfile* EventStateMachine::getStateProfile(StateId state) const {
+  if (!isValidState(state)) return nullptr;
+  return &states[state]->profile;
+}
+
+static void printProfileCounter(Print& out, const ProfileCounter& counter) {
+  out.print(',');
+  out.print(counter.calls);
+  out.print(',');
+  out.print(counter.totalTime);
+  out.print(',');
+  out.print(counter.calls > 0 ? counter.minTime : 0);
+  out.print(',');
+  out.print(counter.maxTime);
+}
+
+static void printCallbackProfiles(Print& out, StateId state, char kind, const ProfileCounter* counters, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out.print("C,");
+    out.print(state);
+    out.print(',');
+    out.print(kind);
+    out.print(',');
+    out.print((unsigned int)i);
+    printProfileCounter(out, counters[i]);
+    out.println();
+  }
+}
+
+void EventStateMachine::printProfile(Print& out) const {
+  out.println("S,state,entries,timeInStateMs,trCalls,trTotal,trMin,trMax,updCalls,updTotal,updMin,updMax,toCalls,toTotal,toMin,toMax");
+  out.println("C,state,kind,index,calls,total,min,max");
+  
+  for (StateId s = 0; s < numStates; s++) {
+    const StateProfile& profile = states[s]->profile;
+    uint64_t timeInState = profile.timeInState;
+    const RegionState& region = regions[regionOf(s)];
+    if (s == region.current) {
+      timeInState += esmTicksToMillis(esmClock() - region.profileStart);
+    }
+    
+    out.print("S,");
+    out.print(s);
+    out.print(',');
+    out.print(profile.entries);
+    out.print(',');
+    out.print(timeInState);
+    printProfileCounter(out, profile.transitions);
+    printProfileCounter(out, profile.updates);
+    printProfileCounter(out, profile.timeouts);
+    out.println();
+    
+    // Callback di entrata (E), durante (S), uscita (X) e timeout (T)
+    if (frozen) {
+      const FrozenSpan& span = states[s]->frozenSpan;
+      const ProfileCounter* counters = &frozenProfiles[span.offset];
+      printCallbackProfiles(out, s, 'E', counters, span.numEnters);
+      counters += span.numEnters;
+      printCallbackProfiles(out, s, 'S', counters, span.numStates);
+      counters += span.numStates;
+      printCallbackProfiles(out, s, 'X', counters, span.numExits);
+      counters += span.numExits;
+      printCallbackProfiles(out, s, 'T', counters, span.numTimeouts);
+    } else {
+      const StateDefinition& def = *states[s];
+      printCallbackProfiles(out, s, 'E', def.enterProfiles.data(), def.enterProfiles.size());
+      printCallbackProfiles(out, s, 'S', def.stateProfiles.data(), def.stateProfiles.size());
+      printCallbackProfiles(out, s, 'X', def.exitProfiles.data(), def.exitProfiles.size());
+      printCallbackProfiles(out, s, 'T', def.timeoutProfiles.data(), def.timeoutProfiles.size());
+    }
+  }
+}
+
+void EventStateMachine::resetProfile() {
+  for (StateId s = 0; s < numStates; s++) {
+    StateDefinition& def = *states[s];
+    def.profile = StateProfile();
+    std::fill(def.enterProfiles.begin(), def.enterProfiles.end(), ProfileCounter());
+    std::fill(def.stateProfiles.begin(), def.stateProfiles.end(), ProfileCounter());
+    std::fill(def.exitProfiles.begin(), def.exitProfiles.end(), ProfileCounter());
+    std::fill(def.timeoutProfiles.begin(), def.timeoutProfiles.end(), ProfileCounter());
+  }
+  std::fill(frozenProfiles.begin(), frozenProfiles.end(), ProfileCounter());
+  
+  // Il tempo negli stati correnti viene contato da adesso
+  EsmTime now = esmClock();
+  for (uint8_t r = 0; r < regionCount; r++) {
+    regions[r].profileStart = now;
+  }
 }
+#endif // ESM_PROFILING
 
-#endif // defined(ESP8266) || defined(ESP32)
\ No newline at end of file
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
\ No newline at end of file
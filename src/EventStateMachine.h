@@ -7,112 +7,799 @@
 #ifndef EVENT_STATE_MACHINE_H
 #define EVENT_STATE_MACHINE_H
 
-#include <Arduino.h>
-#if defined(ESP8266) || defined(ESP32)
-#include <Ticker.h>
+#include "EsmPlatform.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include "EsmClock.h"
+#include "EsmAllocator.h"
+#include "RingBuffer.h"
+#include "StateTrace.h"
+#include "StateTask.h"
+#include "EsmDelegate.h"
+#include "CallbackList.h"
+
+static_assert(sizeof(StateId) <= 2 && StateId(-1) > 0, "ESM_STATE_ID_TYPE must be uint8_t or uint16_t");
+
+// Dimensione della coda dei timeout in modalità differita (potenza di 2)
+#ifndef ESM_DEFERRED_QUEUE_SIZE
+#define ESM_DEFERRED_QUEUE_SIZE 8
+#endif
+
+// Dimensione della coda degli eventi di postEvent() (potenza di 2)
+#ifndef ESM_EVENT_QUEUE_SIZE
+#define ESM_EVENT_QUEUE_SIZE 16
+#endif
+
+// Modalità thread-safe (ESP32/FreeRTOS): i campi di stato diventano atomici e le
+// transizioni richieste da altri task vengono inoltrate al task proprietario
+#ifndef ESM_THREAD_SAFE
+#define ESM_THREAD_SAFE 0
+#endif
+
+// Dimensione della coda delle richieste tra task (potenza di 2)
+#ifndef ESM_REQUEST_QUEUE_SIZE
+#define ESM_REQUEST_QUEUE_SIZE 8
+#endif
+
+// Voci dello storico delle transizioni (0 = storico disattivato)
+#ifndef ESM_HISTORY_SIZE
+#define ESM_HISTORY_SIZE 8
+#endif
+
+// Profiler dei callback: a 0 non aggiunge né codice né memoria
+#ifndef ESM_PROFILING
+#define ESM_PROFILING 0
+#endif
+
+// Sorgente dei tempi del profiler: l'orologio della libreria (EsmClock.h), in tick,
+// oppure con ESM_PROFILING_CYCLES il contatore di cicli del core che esegue la
+// misura. Le misure sono differenze brevi nello stesso contesto: il contatore non
+// viene esteso e non cambia l'orologio della libreria
+#ifndef ESM_PROFILE_CLOCK
+#if defined(ESM_PROFILING_CYCLES) && !defined(ESM_HOST)
+#define ESM_PROFILE_CLOCK() ESP.getCycleCount()
+#else
+#define ESM_PROFILE_CLOCK() ((uint32_t)esmClock())
+#endif
+#endif
+
+// Profondità massima della gerarchia degli stati (stato foglia incluso)
+#ifndef ESM_MAX_STATE_DEPTH
+#define ESM_MAX_STATE_DEPTH 8
+#endif
+
+// Numero massimo di regioni ortogonali (addRegion()), compresa la regione principale
+#ifndef ESM_MAX_REGIONS
+#define ESM_MAX_REGIONS 4
+#endif
+#define ESM_NO_REGION 0xFF
+
+// Valore di getParent() per gli stati senza padre (il valore massimo di StateId,
+// quindi al massimo 255 stati con uint8_t e 65535 con uint16_t)
+#define ESM_NO_STATE ((StateId)~(StateId)0)
+
+// Valore di getTimeToNextTimeout() senza timeout in attesa
+#define ESM_NO_TIMEOUT ((unsigned long)-1)
+
+#if ESM_PROFILING
+#define ESM_PROFILED(counter, call) do { uint32_t esmStart = ESM_PROFILE_CLOCK(); call; (counter).record(ESM_PROFILE_CLOCK() - esmStart); } while (0)
+#else
+#define ESM_PROFILED(counter, call) call
+#endif
+
+// Trace: con debug attivo accoda un TraceEvent binario, la formattazione avviene in
+// update(). Con ESM_TRACE_LEVEL a 0 le chiamate spariscono dal codice compilato
+#if ESM_TRACE_LEVEL > 0
+#define ESM_TRACE(type, state, index, value) do { if (traceEventLevel(type) <= ESM_TRACE_LEVEL && debugEnabled) trace(type, state, index, value); } while (0)
+#else
+#define ESM_TRACE(type, state, index, value) do {} while (0)
+#endif
+
+#if ESM_THREAD_SAFE
+template <typename T> using EsmShared = std::atomic<T>;
+#else
+template <typename T> using EsmShared = T;
+#endif
 
 // Definizione del tipo di funzione per i callback
-typedef void (*StateCallback)(uint8_t currentState, uint8_t otherState);
-typedef void (*StateFunction)(uint8_t state);
-typedef void (*GlobalStateCallback)(uint8_t fromState, uint8_t toState);
+typedef void (*StateCallback)(StateId currentState, StateId otherState);
+typedef void (*StateFunction)(StateId state);
+typedef void (*GlobalStateCallback)(StateId fromState, StateId toState);
+typedef bool (*TransitionGuard)(StateId state, uint8_t eventId, uint32_t payload);
+
+// Callback con contesto accettati dai metodi add*: una funzione, un metodo legato
+// a un oggetto o una lambda con piccole catture, senza allocazioni
+typedef EsmDelegate<void(StateId currentState, StateId otherState)> StateDelegate;
+typedef EsmDelegate<void(StateId state)> StateFunctionDelegate;
+typedef EsmDelegate<void(StateId fromState, StateId toState)> GlobalStateDelegate;
+
+// Identificativo stabile di un callback registrato, restituito dai metodi add*
+// e accettato da removeCallback(). 0 = registrazione non riuscita. Contiene lo
+// stato: a 32 bit con StateId a 8 bit, a 64 bit con StateId a 16 bit
+typedef std::conditional<sizeof(StateId) == 1, uint32_t, uint64_t>::type CallbackHandle;
+#define ESM_INVALID_HANDLE 0
 
 // Definizione della struttura timeout 
 struct TimeoutInfo {
-  unsigned long duration;      // Durata in millisecondi
-  StateCallback callback;      // Funzione callback
-  Ticker ticker;               // Ticker per la gestione del timeout
+  unsigned long duration;      // Durata (o periodo) in millisecondi
+  StateDelegate callback;      // Funzione callback
+  bool periodic;               // true = riaccodato ad ogni scadenza finché lo stato è attivo
+};
+
+// Scadenza accodata nello scheduler condiviso dei timeout
+struct TimeoutEntry {
+  EsmTime deadline;            // Istante di scadenza (in tick di esmClock())
+  uint8_t index;               // Indice del timeout nello stato a cui appartiene
+  StateId state;               // Stato attivo (foglia o antenato) che ha impostato il timeout
+  uint16_t generation;         // Visita dello stato per cui è stato accodato
+};
+
+// Ordinamento del min-heap: in cima resta la scadenza più vicina (a 64 bit non c'è rollover)
+inline bool timeoutExpiresLater(const TimeoutEntry& a, const TimeoutEntry& b) {
+  return a.deadline > b.deadline;
+}
+
+// Record compatto prodotto dal Ticker in modalità differita
+struct TimeoutEvent {
+  StateId state;               // Stato per cui il Ticker era armato
+  uint16_t generation;         // Visita dello stato a cui appartiene
+};
+
+// Evento accodato con postEvent()
+struct StateEvent {
+  uint8_t eventId;             // Identificativo dell'evento
+  uint32_t payload;            // Dato associato all'evento
+};
+
+// Riga della tabella delle transizioni: evento -> stato di destinazione
+struct TransitionInfo {
+  uint8_t eventId;             // Evento che attiva la transizione
+  StateId targetState;         // Stato di destinazione
+  TransitionGuard guard;       // Condizione opzionale (nullptr = sempre)
+};
+
+// Riga della tabella di configurazione di loadStates(): gli stessi parametri di
+// configureState(), più il padre. Con funzioni semplici la tabella può essere
+// constexpr o PROGMEM; più righe per lo stesso stato aggiungono altri callback
+struct StateConfig {
+  StateId state;               // Stato da configurare
+  unsigned long timeout;       // Durata del timeout (0 = nessuno)
+  StateCallback onEnter;       // Callback opzionali (nullptr = nessuno)
+  StateFunction onState;
+  StateCallback onExit;
+  StateCallback onTimeout;
+  StateId parent = ESM_NO_STATE; // Stato padre (ESM_NO_STATE = invariato)
+};
+
+// Riga della tabella di loadTransitions(), come i parametri di addTransition()
+struct TransitionConfig {
+  StateId state;               // Stato in cui vale la transizione
+  uint8_t eventId;             // Evento che attiva la transizione
+  StateId targetState;         // Stato di destinazione
+  TransitionGuard guard;       // Condizione opzionale (nullptr = sempre)
+};
+
+// Richiesta inoltrata al task proprietario in modalità thread-safe
+struct StateRequest {
+  bool isEvent;                // true = postEvent(), false = setState()
+  StateId value;               // Stato di destinazione o identificativo dell'evento
+  uint32_t payload;            // Dato associato all'evento
+};
+
+// Origine di una transizione nello storico
+enum TransitionCause : uint8_t {
+  TRANSITION_DIRECT = 0,       // setState() chiamato dall'applicazione o da un callback
+  TRANSITION_TIMEOUT,          // setState() chiamato da un callback di timeout
+  TRANSITION_EVENT             // riga della tabella delle transizioni
+};
+
+// Voce dello storico delle transizioni
+struct TransitionHistoryEntry {
+  uint32_t timestamp;          // esmMillis() al momento della transizione
+  StateId fromState;           // Stato di partenza
+  StateId toState;             // Stato di arrivo
+  uint8_t cause;               // TransitionCause
+  uint8_t detail;              // Evento o indice del timeout che ha causato la transizione
+};
+
+// Misure del costo della concorrenza in modalità thread-safe
+struct ConcurrencyStats {
+  uint32_t marshalledRequests; // Richieste inoltrate da altri task
+  uint32_t droppedRequests;    // Richieste perse per coda piena
+  uint32_t lockWaitCycles;     // Cicli CPU totali spesi per acquisire il lock
+  uint32_t maxLockWaitCycles;  // Attesa massima per il lock (cicli CPU)
+};
+
+// Numero massimo di stati per enableStatistics(): la matrice delle transizioni per
+// coppia occupa numStates * numStates contatori da 32 bit
+#ifndef ESM_STATISTICS_MAX_STATES
+#define ESM_STATISTICS_MAX_STATES 64
+#endif
+
+// Contatori di esercizio di uno stato, attivi dopo enableStatistics()
+struct StateStatistics {
+  uint32_t entries;            // Ingressi nello stato
+  uint32_t timeInState;        // Tempo nello stato (ms), esclusa la visita in corso
+  uint32_t timeoutsFired;      // Timeout e timer periodici eseguiti
+};
+
+#if ESM_PROFILING
+// Contatori di esecuzione (tempi nell'unità di ESM_PROFILE_CLOCK)
+struct ProfileCounter {
+  uint32_t calls;              // Numero di esecuzioni
+  uint64_t totalTime;          // Tempo cumulativo
+  uint32_t minTime;            // Esecuzione più breve
+  uint32_t maxTime;            // Esecuzione più lunga
+  
+  ProfileCounter() : calls(0), totalTime(0), minTime(UINT32_MAX), maxTime(0) {}
+  
+  void record(uint32_t elapsed) {
+    calls++;
+    totalTime += elapsed;
+    if (elapsed < minTime) minTime = elapsed;
+    if (elapsed > maxTime) maxTime = elapsed;
+  }
+};
+
+// Profilo di uno stato
+struct StateProfile {
+  uint32_t entries;            // Ingressi nello stato
+  uint64_t timeInState;        // Tempo totale trascorso nello stato (ms)
+  ProfileCounter transitions;  // setState() completi verso lo stato
+  ProfileCounter updates;      // Esecuzione di tutti gli onState in un update()
+  ProfileCounter timeouts;     // Dispatch dei timeout dello stato
+  
+  StateProfile() : entries(0), timeInState(0) {}
+};
+#endif
+
+// Porzione della tabella congelata che appartiene a uno stato, nell'ordine
+// onEnter, onState, onExit, timeout
+struct FrozenSpan {
+  uint16_t offset;             // Prima voce dello stato
+  uint8_t numEnters;
+  uint8_t numStates;
+  uint8_t numExits;
+  uint8_t numTimeouts;
+};
+
+// Struttura per la definizione di uno stato, allocata solo per gli stati configurati
+// Riepilogo delle liste non vuote di uno stato: setState() salta il lavoro inutile
+enum StateFlags : uint8_t {
+  STATE_HAS_ENTERS = 0x01,
+  STATE_HAS_STATES = 0x02,
+  STATE_HAS_EXITS = 0x04,
+  STATE_HAS_TIMEOUTS = 0x08,
+  STATE_HAS_TASK = 0x10
 };
 
-// Struttura per la definizione di uno stato
 struct StateDefinition {
-  std::vector<TimeoutInfo> timeouts;                            // Informazioni sui timeout
-  std::vector<StateCallback> onEnters;                          // Callback all'entrata dello stato
-  std::vector<StateFunction> onStates;                          // Callback durante lo stato
-  std::vector<StateCallback> onExits;                           // Callback all'uscita dello stato
+  CallbackList<TimeoutInfo> timeouts;                           // Informazioni sui timeout
+  EsmVector<TransitionInfo> transitions;                        // Transizioni attivate da eventi
+  CallbackList<StateDelegate> onEnters;                         // Callback all'entrata dello stato
+  CallbackList<StateFunctionDelegate> onStates;                 // Callback durante lo stato
+  CallbackList<StateDelegate> onExits;                          // Callback all'uscita dello stato
+  StateId parent = ESM_NO_STATE;                                // Stato padre nella gerarchia
+  unsigned long onStateInterval = 0;                            // Intervallo minimo degli onState (0 = ogni update())
+  EsmTime nextOnStateRun = 0;                                   // Prossima esecuzione degli onState (in tick)
+  FrozenSpan frozenSpan = {};                                   // Voci nella tabella congelata
+  uint16_t visitGeneration = 0;                                 // Visita in corso (0 = stato non attivo)
+  uint8_t flags = 0;                                            // StateFlags delle liste con voci attive
+  uint8_t region = 0;                                           // Regione ortogonale (solo per gli stati radice)
+  StateTask* task = nullptr;                                    // Corpo riprendibile (setStateTask()), allocato a parte
+#if ESM_PROFILING
+  StateProfile profile;                                         // Statistiche dello stato
+  EsmVector<ProfileCounter> timeoutProfiles;                    // Un contatore per callback,
+  EsmVector<ProfileCounter> enterProfiles;                      // allo stesso indice della
+  EsmVector<ProfileCounter> stateProfiles;                      // lista corrispondente
+  EsmVector<ProfileCounter> exitProfiles;
+#endif
+  
+  // Tutte le liste prendono la memoria dall'area di configurazione dell'allocatore
+  explicit StateDefinition(EsmAllocator* allocator = &EsmAllocator::heap())
+    : StateDefinition(EsmStlAllocator<uint8_t>(allocator, ESM_MEMORY_CONFIG)) {}
+  
+  explicit StateDefinition(const EsmStlAllocator<uint8_t>& memory)
+    : timeouts(memory), transitions(memory), onEnters(memory), onStates(memory), onExits(memory)
+#if ESM_PROFILING
+    , timeoutProfiles(memory), enterProfiles(memory), stateProfiles(memory), exitProfiles(memory)
+#endif
+  {}
+};
+
+class StatePersistence;
+class EsmScheduler;
+
+template <StateId NumStates>
+struct TransitionMatrix;
+
+// Voce della tabella congelata: tutti i callback in un unico array contiguo
+struct FrozenCallback {
+  union {
+    StateDelegate callback;            // onEnter, onExit e timeout
+    StateFunctionDelegate function;    // onState
+  };
+  unsigned long duration;      // Durata in millisecondi (solo per i timeout)
+  uint16_t generation;         // Generazione della voce, 0 = posizione libera
+  bool periodic;               // Timer periodico (solo per i timeout)
+  
+  FrozenCallback() : callback(), duration(0), generation(0), periodic(false) {}
+};
+
+// Regione ortogonale: uno stato corrente indipendente, mentre coda degli eventi,
+// timeout e update() sono condivisi da tutte le regioni della macchina
+struct RegionState {
+  StateId current;
+  StateId previous;
+  EsmTime enteredTime;
+  EsmTime statisticsVisitStart;         // Inizio della visita in corso (enableStatistics())
+#if ESM_PROFILING
+  EsmTime profileStart;                 // Inizio del conteggio del tempo nello stato
+#endif
 };
 
 class EventStateMachine {
 private:
-  uint8_t currentState;
-  uint8_t previousState;
-  bool stateChanged;
-  StateDefinition* states;
-  uint8_t numStates;
-  unsigned long stateEnteredTime;
+  EsmShared<StateId> currentState;
+  EsmShared<StateId> previousState;
+  EsmShared<bool> stateChanged;
+  // Tabella compatta: un puntatore per stato. Gli stati senza callback, timeout,
+  // transizioni o padre puntano tutti a emptyState e non occupano altra memoria
+  StateDefinition** states;
+  StateId numStates;
+  static StateDefinition emptyState;
+  static StateDefinition* emptyStateTable[1];   // Tabella di ripiego se l'allocazione fallisce
+  
+  // Sorgente di tutta la memoria della macchina (tabelle, liste, coda dei timeout)
+  EsmAllocator* allocator;
+  StateDefinition* createDefinition();
+  void destroyDefinition(StateDefinition* definition);
+  
+  // Definizioni allocate in un unico blocco dal primo loadStates()/loadTransitions()
+  StateDefinition* definitionBlock;
+  StateId definitionBlockSize;
+  
+  bool isBlockDefinition(const StateDefinition* definition) const {
+    return definition >= definitionBlock && definition < definitionBlock + definitionBlockSize;
+  }
+  
+  // Caricamento in blocco: conta le voci per stato, riserva ogni lista una sola volta
+  // e poi registra le righe
+  bool loadStateTable(const StateConfig* table, size_t count, bool progmem);
+  bool loadTransitionTable(const TransitionConfig* table, size_t count, bool progmem);
+  void defineStates(const uint8_t* counts, size_t stride);  // Definisce in un solo blocco gli stati contati
+  bool assignParent(StateId state, StateId parent);         // setParent() senza reserveTimeouts()
+  
+  // Definizione in sola lettura (emptyState per gli stati non configurati)
+  const StateDefinition& stateAt(StateId state) const { return *states[state]; }
+  
+  // Definizione modificabile, allocata al primo utilizzo. nullptr se l'allocatore
+  // non ha memoria: lo stato resta non configurato
+  StateDefinition* defineState(StateId state);
+  EsmShared<EsmTime> stateEnteredTime;
+  EsmTime clockTime;                        // Ultima lettura dell'orologio (getTime())
+  EsmTime readClock() { return clockTime = esmClock(); }
   bool debugEnabled;
   
+#if ESM_TRACE_LEVEL > 0
+  // Ring dei TraceEvent: push dal percorso critico, formattazione in update()
+  RingBuffer<TraceEvent, ESM_TRACE_BUFFER_SIZE> traceEvents;
+  std::atomic<uint32_t> droppedTraceEvents;
+  Print* traceOutput;
+#if defined(ESP32)
+  portMUX_TYPE traceLock;                   // Serializza i produttori (loop e task del Ticker)
+#endif
+  
+  void trace(uint8_t type, StateId state, uint8_t index, uint32_t value);
+#endif
+  
+  // Modalità congelata: i vector degli stati vengono compattati in frozenCallbacks
+  bool frozen;
+  EsmVector<FrozenCallback> frozenCallbacks;
+#if ESM_PROFILING
+  EsmVector<ProfileCounter> frozenProfiles;     // Parallelo a frozenCallbacks
+#endif
+  
+  // Log persistente delle transizioni (opzionale)
+  StatePersistence* persistence;
+  
   // Handler globali per transizioni di stato
-  std::vector<GlobalStateCallback> beforeStateChangeHandlers;
-  std::vector<GlobalStateCallback> afterStateChangeHandlers;
+  CallbackList<GlobalStateDelegate> beforeStateChangeHandlers;
+  CallbackList<GlobalStateDelegate> afterStateChangeHandlers;
+  
+  // Generazione assegnata alla prossima registrazione, parte dei CallbackHandle
+  uint16_t handleGeneration;
+  uint16_t nextHandleGeneration();
+  template <typename T>
+  CallbackHandle registerCallback(CallbackList<T>& list, uint8_t kind, StateId state, const T& value);
+  CallbackHandle registerTimeout(StateId state, unsigned long duration, StateDelegate callback, bool periodic);
+  
+  // Scheduler dei timeout: un solo Ticker per tutta la macchina e un min-heap
+  // che contiene solo le scadenze dello stato attivo e dei suoi antenati
+  Ticker timeoutTicker;
+  bool timeoutTickerArmed;                  // Armato e non ancora staccato (detach() solo se serve)
+  EsmVector<TimeoutEntry> pendingTimeouts;
+  
+  // Modalità differita: il Ticker accoda solo un TimeoutEvent, update() esegue i callback
+  bool deferredTimeouts;
+  uint16_t stateGeneration;                 // Incrementato ad ogni cambio di stato (mai 0)
+  RingBuffer<TimeoutEvent, ESM_DEFERRED_QUEUE_SIZE> timeoutEvents;
+  std::atomic<bool> timeoutEventsOverflow;
+  std::atomic<uint32_t> armedTimeout;       // TimeoutEvent impacchettato su cui è armato il Ticker
+  
+  // Coda degli eventi elaborata da update() in modalità run-to-completion
+  RingBuffer<StateEvent, ESM_EVENT_QUEUE_SIZE> events;
+  uint8_t maxEventsPerUpdate;
+  
+  // Un setState() chiamato durante una transizione viene applicato al termine
+  // di quella in corso, senza ricorsione. Se ne arrivano più d'uno vince l'ultimo
+  bool inTransition;
+  bool hasPendingState;
+  StateId pendingState;
+  uint32_t droppedStateRequests;            // Richieste in sospeso sostituite da una successiva
+  
+  // Bitset delle transizioni ammesse (TransitionMatrix), nullptr = tutte ammesse
+  const uint8_t* allowedTransitions;
+  uint32_t rejectedTransitions;
+  
+  // Contatori di esercizio (enableStatistics()), nullptr = disattivati
+  StateStatistics* stateStatistics;
+  uint32_t* transitionPairs;                // numStates x numStates, indice da * numStates + a
+  
+  // Regioni ortogonali: la regione 0 viene pubblicata anche in currentState,
+  // previousState e stateEnteredTime per i getter chiamati da altri task
+  RegionState regions[ESM_MAX_REGIONS];
+  uint8_t regionCount;
+  uint8_t regionOf(StateId state) const;    // Regione dello stato radice
+  void enterStates(StateId state, StateId ancestor, StateId fromState, EsmTime enteredTime);
+  
+  // Scheduler che esegue la macchina (EsmScheduler.h), nullptr = update() dall'applicazione
+  EsmScheduler* scheduler;
+  uint8_t schedulerIndex;
+  friend class EsmScheduler;
+  void notifyScheduler();                   // Chiede allo scheduler un nuovo passaggio
+  bool hasPendingWork() const;              // Eventi, richieste, trace, record o corpi pronti
+  bool getNextWakeup(EsmTime& wakeup) const;        // Timeout o onState più vicino
+  
+  // Snapshot (StateSnapshot.cpp)
+  bool inSnapshot(StateId state) const;
+  void countCallbacks(StateId state, uint8_t& enters, uint8_t& onStates, uint8_t& exits) const;
+  uint32_t snapshotTimeInState(StateId state) const;
+  
+  // Causa assegnata ai setState() chiamati dal contesto corrente (timeout, evento)
+  uint8_t activeCause;
+  uint8_t activeDetail;
+  uint8_t pendingCause;
+  uint8_t pendingDetail;
+  
+#if ESM_HISTORY_SIZE > 0
+  // Storico a sovrascrittura, pubblicato con un seqlock: setState() non attende mai,
+  // chi legge ripete la copia se nel frattempo è stata scritta una voce
+  TransitionHistoryEntry history[ESM_HISTORY_SIZE];
+  std::atomic<uint32_t> historySequence;    // 2 per voce scritta, dispari durante la scrittura
+  
+  void recordHistory(StateId fromState, StateId toState, uint8_t cause, uint8_t detail);
+#endif
   
   // Verifica se uno stato è valido
-  bool isValidState(uint8_t state) const;
+  bool isValidState(StateId state) const;
+  
+  // Dispatch dei callback, comune alla modalità normale e a quella congelata
+  void runOnEnters(StateId state, StateId otherState);
+  void runOnStates(StateId state);
+  void runOnExits(StateId state, StateId otherState);
+  size_t timeoutCount(StateId state) const;
+  TimeoutInfo timeoutAt(StateId state, uint8_t timeoutIndex) const;
+  void updateStateFlags(StateId state);     // Ricalcola i StateFlags dopo un'aggiunta o una rimozione
+  void detachTimeoutTicker();
+  
+  // Gerarchia degli stati
+  uint8_t stateDepth(StateId state) const;
+  StateId commonAncestor(StateId a, StateId b) const;  // ESM_NO_STATE se non ne esiste uno
+  void runActiveStates(StateId state);      // onState dagli antenati fino allo stato foglia
+  
+  // Corpi riprendibili (setStateTask()): le attese a tempo usano la coda dei timeout
+  // con un indice riservato
+  static const uint8_t TASK_TIMEOUT_INDEX = 0xFF;
+  void startTask(StateId state);            // Ingresso nello stato: il corpo riparte dall'inizio
+  void resumeTask(StateId state);           // Esegue il corpo fino alla prossima attesa
+  void cancelTask(StateId state);           // Uscita dallo stato
+  bool deliverTaskEvent(uint8_t region, const StateEvent& event);
+  void resumeReadyTasks(uint8_t region);
+  bool hasReadyTasks() const;
+  void destroyTask(StateDefinition& def);
+  const TransitionInfo* findTransition(StateId state, const StateEvent& event) const;
+  void reserveTimeouts();                   // Riserva la coda per le catene con più timeout e corpi
+  
+  // Gestione della coda dei timeout
+  void scheduleTimeouts(StateId state, EsmTime now); // Accoda i timeout di uno stato in entrata
+  void cancelTimeouts(StateId state);       // Toglie dalla coda i timeout di uno stato in uscita, O(n) nella coda
+  void armTimeoutTicker();                  // Arma il Ticker sulla scadenza più vicina
+  void unschedulePendingTimeout(StateId state, uint8_t timeoutIndex);
+  void reschedulePeriodic(const TimeoutEntry& expired); // Riaccoda un timer periodico scaduto
+  void processTimeouts();                   // Esegue i timeout scaduti
+  void processDeferredTimeouts();           // Svuota la coda differita in update()
+  void onTimerExpired();
   
-  // Funzioni statiche per i callback dei Ticker
-  static EventStateMachine* instance; // Istanza globale per i callback statici
-  static void onTimeoutStatic(uint8_t state, uint8_t timeoutIndex);
+  // Il Ticker riceve direttamente il puntatore all'istanza: nessuna lookup globale
+  static void onTimeoutStatic(EventStateMachine* machine);
+  
+  void performTransition(StateId newState, uint8_t cause, uint8_t detail); // Esegue una singola transizione
+  void processEvents();                     // Elabora gli eventi in coda
+
+#if ESM_THREAD_SAFE
+  // Richieste di altri task: i produttori si serializzano con uno spinlock,
+  // il task proprietario le consuma senza lock in update()
+  RingBuffer<StateRequest, ESM_REQUEST_QUEUE_SIZE> requests;
+  ConcurrencyStats concurrencyStats;
+#if defined(ESP32)
+  TaskHandle_t ownerTask;
+  portMUX_TYPE requestLock;
+#endif
+  
+  bool isOwnerContext() const;
+  bool marshalRequest(bool isEvent, StateId value, uint32_t payload);   // false se la coda è piena
+  void processRequests();
+#endif
 
 public:
-  EventStateMachine(uint8_t numberOfStates);
+  // Senza allocatore la memoria viene dall'heap globale (EsmAllocator::heap()).
+  // Se la tabella degli stati non può essere allocata getNumStates() vale 0
+  EventStateMachine(StateId numberOfStates, EsmAllocator* allocator = nullptr);
   ~EventStateMachine();
   
-  // Metodo per impostare l'istanza globale
-  void setInstance() { instance = this; }
+  // Allocatore della macchina, con i byte in uso e l'high-water per area
+  EsmAllocator& getAllocator() const { return *allocator; }
+  StateId getNumStates() const { return numStates; }
   
-  // Abilita/disabilita i messaggi di debug
+  // Scheduler a cui la macchina è stata aggiunta (EsmScheduler::add()), nullptr se nessuno
+  EsmScheduler* getScheduler() const { return scheduler; }
+  
+  // Mantenuto per compatibilità: ogni istanza riceve già i propri timeout
+  void setInstance() {}
+  
+  // Abilita/disabilita i messaggi di debug: gli eventi vengono registrati in
+  // formato binario e stampati da update() sull'uscita di debug
   void setDebug(bool enable) { debugEnabled = enable; }
   
+  // Uscita su cui update() formatta il trace (default Serial, nullptr = nessuna:
+  // gli eventi si leggono con popTraceEvent())
+  void setDebugOutput(Print* out);
+  
+  // Lettura diretta del trace binario
+  bool popTraceEvent(TraceEvent& event);
+  void printTrace(Print& out, size_t maxEvents = SIZE_MAX);
+  uint32_t getDroppedTraceEvents() const;
+  
+  // Abilita/disabilita la modalità differita dei timeout: i callback di timeout
+  // vengono eseguiti dal successivo update() invece che nel contesto del Ticker
+  void setDeferredTimeouts(bool enable);
+  bool isDeferredTimeouts() const { return deferredTimeouts; }
+  
+  // Compatta tutti i callback in un unico array contiguo con un intervallo per stato:
+  // update() e setState() scorrono memoria adiacente. Mentre la macchina è congelata
+  // i metodi add*/remove* dei callback di stato restituiscono false
+  bool freeze();
+  void unfreeze();
+  bool isFrozen() const { return frozen; }
+  
+  // Registra ogni transizione nel log binario (nullptr per disattivarlo);
+  // update() esegue il flush a blocchi secondo la politica del log
+  void setPersistence(StatePersistence* log) { persistence = log; }
+  
   // Metodo di configurazione completo
-  void configureState(uint8_t state, unsigned long timeout = 0,
-                      StateCallback onEnter = nullptr,
-                      StateFunction onState = nullptr,
-                      StateCallback onExit = nullptr,
-                      StateCallback onTimeout = nullptr);
-  
-  // Metodi per aggiungere callback specifici
-  bool addTimeout(uint8_t state, unsigned long timeout, StateCallback onTimeout);
-  bool addOnEnter(uint8_t state, StateCallback onEnter);
-  bool addOnState(uint8_t state, StateFunction onState);
-  bool addOnExit(uint8_t state, StateCallback onExit);
-  
-  // Metodi per rimuovere callback specifici
-  bool removeTimeout(uint8_t state, unsigned long timeout);
-  bool removeOnEnter(uint8_t state, StateCallback onEnter);
-  bool removeOnState(uint8_t state, StateFunction onState);
-  bool removeOnExit(uint8_t state, StateCallback onExit);
+  void configureState(StateId state, unsigned long timeout = 0,
+                      StateDelegate onEnter = nullptr,
+                      StateFunctionDelegate onState = nullptr,
+                      StateDelegate onExit = nullptr,
+                      StateDelegate onTimeout = nullptr);
+  
+  // Configurazione in blocco da una tabella in RAM o in flash (varianti _P): la
+  // memoria di ogni lista viene riservata una sola volta, della dimensione esatta,
+  // e le definizioni degli stati nuovi arrivano da un'unica allocazione. false se
+  // almeno una riga non è valida (le altre vengono comunque caricate)
+  bool loadStates(const StateConfig* table, size_t count);
+  bool loadStates_P(const StateConfig* table, size_t count);
+  bool loadTransitions(const TransitionConfig* table, size_t count);
+  bool loadTransitions_P(const TransitionConfig* table, size_t count);
+  
+  // Metodi per aggiungere callback specifici: restituiscono un handle stabile
+  // (ESM_INVALID_HANDLE in caso di errore)
+  CallbackHandle addTimeout(StateId state, unsigned long timeout, StateDelegate onTimeout);
+  
+  // Timer periodico: scatta ogni 'interval' ms (> 0) dall'ingresso nello stato finché
+  // lo stato resta attivo e viene cancellato all'uscita. Le scadenze perse (update()
+  // o callback troppo lenti) vengono saltate, senza raffiche di recupero
+  CallbackHandle addPeriodicTimeout(StateId state, unsigned long interval, StateDelegate onTimer);
+  CallbackHandle addOnEnter(StateId state, StateDelegate onEnter);
+  CallbackHandle addOnState(StateId state, StateFunctionDelegate onState);
+  CallbackHandle addOnExit(StateId state, StateDelegate onExit);
+  
+  // Esegue gli onState dello stato al massimo ogni 'interval' ms (0 = a ogni update(),
+  // default): gli update() intermedi li saltano con un solo confronto. Il conteggio
+  // riparte all'ingresso nello stato; vale anche in modalità congelata
+  bool setOnStateInterval(StateId state, unsigned long interval);
+  unsigned long getOnStateInterval(StateId state) const;
+  
+  // Corpo riprendibile dello stato (StateTask.h), al posto di un onState interrogato a
+  // ogni update(): parte all'ingresso, viene ripreso solo quando la sua attesa finisce
+  // e viene annullato all'uscita. Uno per stato, nullptr lo rimuove
+  bool setStateTask(StateId state, StateTaskDelegate body);
+  StateTaskStatus getStateTaskStatus(StateId state) const;
+  
+  // Rimozione in O(1) tramite handle, sicura anche durante la dispatch: un
+  // callback rimosso non viene più eseguito, gli altri restano al loro posto
+  bool removeCallback(CallbackHandle handle);
+  
+  // Metodi per rimuovere callback specifici (ricerca lineare del primo uguale)
+  bool removeTimeout(StateId state, unsigned long timeout);
+  bool removeOnEnter(StateId state, StateDelegate onEnter);
+  bool removeOnState(StateId state, StateFunctionDelegate onState);
+  bool removeOnExit(StateId state, StateDelegate onExit);
   
   // Metodi per gli handler globali di cambio stato
-  void addBeforeStateChangeHandler(GlobalStateCallback handler);
-  void addAfterStateChangeHandler(GlobalStateCallback handler);
-  bool removeBeforeStateChangeHandler(GlobalStateCallback handler);
-  bool removeAfterStateChangeHandler(GlobalStateCallback handler);
+  CallbackHandle addBeforeStateChangeHandler(GlobalStateDelegate handler);
+  CallbackHandle addAfterStateChangeHandler(GlobalStateDelegate handler);
+  bool removeBeforeStateChangeHandler(GlobalStateDelegate handler);
+  bool removeAfterStateChangeHandler(GlobalStateDelegate handler);
+  
+  // Stati gerarchici: 'state' diventa figlio di 'parent' (ESM_NO_STATE per staccarlo).
+  // Callback, timeout e transizioni del padre valgono per tutti i figli; passando tra
+  // fratelli il padre non esce e i suoi timeout continuano a correre. Da chiamare in
+  // fase di configurazione, false se crea un ciclo o supera ESM_MAX_STATE_DEPTH
+  bool setParent(StateId state, StateId parent);
+  StateId getParent(StateId state) const;
+  
+  // true se 'state' è lo stato corrente della sua regione o uno dei suoi antenati
+  bool isInState(StateId state) const;
+  
+  // Regioni ortogonali: sotto-macchine parallele nella stessa istanza, ognuna con il
+  // proprio stato corrente. Ogni stato radice (senza padre) appartiene a una regione,
+  // la 0 per default, e i figli seguono la radice. addRegion() crea una regione, vi
+  // sposta la radice di initialState e vi entra subito (gli onEnter ricevono
+  // ESM_NO_STATE come stato di provenienza); restituisce l'indice della regione o
+  // ESM_NO_REGION. setState() agisce sulla regione dello stato di arrivo, ogni evento
+  // viene offerto a tutte le regioni nello stesso update() e i timeout di tutte le
+  // regioni condividono lo stesso Ticker. Da chiamare in fase di configurazione
+  uint8_t addRegion(StateId initialState);
+  bool setRegion(StateId state, uint8_t region);      // Sposta uno stato radice non attivo
+  uint8_t getRegion(StateId state) const;
+  uint8_t getRegionCount() const { return regionCount; }
+  
+  // Tabella delle transizioni: in 'state' l'evento 'eventId' porta a 'targetState'
+  // se la guardia (opzionale) restituisce true. Vale la prima riga che corrisponde,
+  // cercata prima nello stato corrente e poi risalendo negli stati padre.
+  bool addTransition(StateId state, uint8_t eventId, StateId targetState, TransitionGuard guard = nullptr);
+  bool removeTransition(StateId state, uint8_t eventId);
+  
+  // Transizioni ammesse, da una TransitionMatrix (TransitionMatrix.h) con lo stesso
+  // numero di stati: un setState() verso uno stato non ammesso viene ignorato e
+  // addTransition() rifiuta le transizioni che non potrebbero mai avvenire.
+  // Una transizione è ammessa se lo è dallo stato corrente o da uno dei suoi antenati
+  template <StateId NumStates>
+  bool setAllowedTransitions(const TransitionMatrix<NumStates>& matrix);
+  bool setAllowedTransitions(const uint8_t* matrix, StateId matrixStates);   // nullptr = tutte ammesse
+  bool isTransitionAllowed(StateId fromState, StateId toState) const;
+  uint32_t getRejectedTransitions() const { return rejectedTransitions; }
+  
+  // Contatori di esercizio: ingressi, tempo e timeout eseguiti per stato e una
+  // matrice delle transizioni per coppia di stati, aggiornata in O(1) da setState().
+  // La memoria viene dall'allocatore; false oltre ESM_STATISTICS_MAX_STATES stati
+  bool enableStatistics();
+  void resetStatistics();
+  const StateStatistics* getStateStatistics(StateId state) const;
+  uint32_t getTransitionPairCount(StateId fromState, StateId toState) const;
+  
+  // Snapshot della struttura e dei contatori scritto direttamente su 'out', senza
+  // String né buffer intermedi: formato binario compatto (descritto in
+  // StateSnapshot.h) oppure JSON. Restituiscono il numero di byte scritti
+  size_t writeSnapshot(Print& out) const;
+  size_t printSnapshotJson(Print& out) const;
+  
+  // Accoda un evento, elaborato dal prossimo update(). false se la coda è piena
+  bool postEvent(uint8_t eventId, uint32_t payload = 0);
+  
+  // Numero massimo di eventi elaborati per ogni update()
+  void setMaxEventsPerUpdate(uint8_t maxEvents) { maxEventsPerUpdate = maxEvents; }
+  
+  // Numero di eventi in attesa di essere elaborati
+  size_t getPendingEvents() const { return events.size(); }
+  
+  // Scadenza più vicina (in tick di esmClock()) tra i timeout dello stato attivo
+  // e dei suoi antenati, false se non ce ne sono
+  bool getNextDeadline(EsmTime& deadline) const;
+  
+  // Millisecondi alla scadenza più vicina (0 se già raggiunta), ESM_NO_TIMEOUT se
+  // non ci sono timeout in attesa
+  unsigned long getTimeToNextTimeout() const;
+  
+  // true se lo stato corrente o uno dei suoi antenati ha callback onState
+  bool hasOnStateCallbacks() const;
+  
+  // true se update() non ha niente da eseguire prima della prossima scadenza:
+  // nessun evento, timeout, richiesta o record in attesa e nessun onState dovuto.
+  // Un onState senza intervallo è sempre dovuto, uno con intervallo lo è alla
+  // sua prossima esecuzione
+  bool isIdle() const;
+  
+  // Se la macchina è inattiva entra in light sleep fino alla prossima scadenza,
+  // timeout o onState con intervallo (al massimo maxSleep ms). Sull'ESP32 restano attive le sorgenti di risveglio
+  // configurate dall'applicazione (GPIO, UART...). Restituisce i ms trascorsi,
+  // 0 se non ha dormito
+  unsigned long sleepUntilNextTimeout(unsigned long maxSleep = ESM_NO_TIMEOUT);
+  
+#if ESM_THREAD_SAFE
+  // Imposta il task che esegue update() (default: il primo task che chiama update()).
+  // setState() e postEvent() chiamati da altri task vengono inoltrati a questo task.
+  // Finché il proprietario non è noto ogni task esegue le chiamate direttamente:
+  // se altri task possono chiamarle prima del primo update(), va impostato qui
+  // (nullptr = task corrente) prima di avviarli
+#if defined(ESP32)
+  void setOwnerTask(TaskHandle_t task = nullptr);
+#endif
+  
+  // Statistiche di contesa tra task
+  ConcurrencyStats getConcurrencyStats();
+  void resetConcurrencyStats();
+#endif
   
   // Callback interno per i timeout
-  void onTimeout(uint8_t state, uint8_t timeoutIndex);
+  void onTimeout(StateId state, uint8_t timeoutIndex);
   
   // Cambia lo stato
-  void setState(uint8_t newState);
+  void setState(StateId newState);
+  uint32_t getDroppedStateRequests() const { return droppedStateRequests; }
   
   // Esecuzione di un ciclo della macchina a stati
   void update();
   
   // Getter per lo stato corrente
-  uint8_t getCurrentState() const;
+  StateId getCurrentState() const;
+  StateId getCurrentState(uint8_t region) const;    // ESM_NO_STATE se la regione non esiste
   
   // Getter per lo stato precedente
-  uint8_t getPreviousState() const;
+  StateId getPreviousState() const;
+  StateId getPreviousState(uint8_t region) const;
   
   // Controlla se lo stato è appena cambiato
   bool isStateChanged() const;
   
   // Tempo trascorso nello stato corrente
   unsigned long timeInCurrentState() const;
+  unsigned long timeInCurrentState(uint8_t region) const;
+  
+  // Come timeInCurrentState(), in microsecondi con la risoluzione di ESM_CLOCK
+  uint64_t timeInCurrentStateMicros() const;
+  uint64_t timeInCurrentStateMicros(uint8_t region) const;
+  
+  // Istante (in tick di esmClock()) dell'ultima lettura dell'orologio fatta dalla
+  // macchina: nei callback è quello della transizione, del timeout o dell'update()
+  // in corso, senza leggere di nuovo l'orologio
+  EsmTime getTime() const { return clockTime; }
+  
+  // Copia in 'entries' le ultime transizioni (al massimo maxEntries, dalla più
+  // vecchia alla più recente) e ne restituisce il numero. Non blocca setState():
+  // può essere chiamato da qualsiasi task, ad esempio un task di diagnostica
+  size_t getHistory(TransitionHistoryEntry* entries, size_t maxEntries) const;
+  
+  // Numero di transizioni registrate dall'avvio
+  uint32_t getTransitionCount() const;
+  
+#if ESM_PROFILING
+  // Statistiche del profiler (ESM_PROFILING=1)
+  const StateProfile* getStateProfile(StateId state) const;
+  
+  // Scrive tutte le statistiche in formato CSV compatto, una riga per stato ("S")
+  // e una per callback ("C"), su Serial o su qualsiasi altro Print
+  void printProfile(Print& out) const;
+  void resetProfile();
+#endif
 };
 
 #else
-#error "This library requires ESP8266 or ESP32 boards"
+#error "This library requires ESP8266 or ESP32 boards (or ESM_HOST for desktop builds)"
 #endif
 
 #endif // EVENT_STATE_MACHINE_H
\ No newline at end of file
@@ -0,0 +1,63 @@
+/*
+  RingBuffer.h - Lock-free single-producer/single-consumer ring buffer
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_RING_BUFFER_H
+#define EVENT_STATE_MACHINE_RING_BUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Coda circolare a dimensione fissa, senza lock e senza allocazioni.
+// Un solo produttore (es. il contesto del Ticker) chiama push(), un solo
+// consumatore (es. update() nel loop) chiama pop(). Size deve essere una potenza di 2.
+template <typename T, size_t Size>
+class RingBuffer {
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0, "RingBuffer size must be a power of two");
+
+private:
+  T items[Size];
+  std::atomic<uint32_t> head;   // Prossima posizione da scrivere (produttore)
+  std::atomic<uint32_t> tail;   // Prossima posizione da leggere (consumatore)
+
+public:
+  RingBuffer() : head(0), tail(0) {}
+  
+  // Inserisce un elemento, false se la coda è piena (lato produttore)
+  bool push(const T& item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= Size) return false;
+    items[h & (Size - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+  
+  // Estrae un elemento, false se la coda è vuota (lato consumatore)
+  bool pop(T& item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return false;
+    item = items[t & (Size - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+  
+  bool empty() const {
+    return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+  }
+  
+  size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+  
+  static constexpr size_t capacity() { return Size; }
+  
+  // Scarta tutti gli elementi in coda (lato consumatore)
+  void clear() {
+    tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+  }
+};
+
+#endif // EVENT_STATE_MACHINE_RING_BUFFER_H
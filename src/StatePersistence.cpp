@@ -0,0 +1,232 @@
+/*
+  StatePersistence.cpp - Batched binary persistence of state transitions
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+#include "StatePersistence.h"
+#include <string.h>
+
+#if ESM_HAS_FS
+
+StatePersistence::StatePersistence() {
+  fileSystem = nullptr;
+  basePath = nullptr;
+  numSegments = 0;
+  recordsPerSegment = 0;
+  batchSize = ESM_PERSISTENCE_BUFFER_SIZE / 2;
+  flushInterval = 5000;
+  nextSequence = 1;
+  currentSegment = 0;
+  recordsInSegment = 0;
+  lastFlush = 0;
+  droppedRecords = 0;
+}
+
+uint16_t StatePersistence::computeChecksum(const TransitionRecord& record) {
+  // Fletcher-16 sui campi che precedono il checksum
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(&record);
+  uint16_t sum1 = 0xFF, sum2 = 0xFF;
+  for (size_t i = 0; i < offsetof(TransitionRecord, checksum); i++) {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+void StatePersistence::segmentPath(uint8_t segment, char* path, size_t size) const {
+  snprintf(path, size, "%s%u.bin", basePath, (unsigned int)segment);
+}
+
+bool StatePersistence::readLastRecord(uint8_t segment, TransitionRecord& record, uint16_t& count) const {
+  char path[32];
+  segmentPath(segment, path, sizeof(path));
+  count = 0;
+  
+  File file = fileSystem->open(path, "r");
+  if (!file) return false;
+  
+  // Parte dall'ultimo record e torna indietro se è stato scritto solo in parte
+  size_t records = file.size() / sizeof(TransitionRecord);
+  count = records;
+  while (records > 0) {
+    records--;
+    file.seek(records * sizeof(TransitionRecord));
+    if (file.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) == sizeof(record) &&
+        record.sequence != 0 && record.checksum == computeChecksum(record)) {
+      file.close();
+      return true;
+    }
+  }
+  
+  file.close();
+  return false;
+}
+
+bool StatePersistence::begin(fs::FS& fileSys, const char* path, uint8_t segments, uint16_t perSegment) {
+  if (segments == 0 || perSegment == 0) return false;
+  
+  fileSystem = &fileSys;
+  basePath = path;
+  numSegments = segments;
+  recordsPerSegment = perSegment;
+  lastFlush = esmMillis();
+  
+  // Riprende dal segmento con il record più recente
+  TransitionRecord record;
+  uint16_t count;
+  uint32_t lastSequence = 0;
+  for (uint8_t s = 0; s < numSegments; s++) {
+    if (readLastRecord(s, record, count) && record.sequence > lastSequence) {
+      lastSequence = record.sequence;
+      currentSegment = s;
+      recordsInSegment = count;
+    }
+  }
+  nextSequence = lastSequence + 1;
+  return true;
+}
+
+void StatePersistence::setFlushPolicy(uint8_t size, unsigned long intervalMs) {
+  batchSize = size > 0 ? size : 1;
+  flushInterval = intervalMs;
+}
+
+bool StatePersistence::record(StateId fromState, StateId toState) {
+  // Azzerato per intero: anche il padding finisce su flash
+  TransitionRecord record;
+  memset(&record, 0, sizeof(record));
+  record.sequence = nextSequence++;
+  record.timestamp = (uint32_t)esmMillis();
+  record.fromState = fromState;
+  record.toState = toState;
+  record.checksum = computeChecksum(record);
+  
+  // Se il ring è pieno si scrive subito: l'ultimo stato non deve andare perso
+  if (pending.push(record)) return true;
+  flush();
+  if (pending.push(record)) return true;
+  
+  // Flash non scrivibile: si sacrifica il record più vecchio, che vale meno
+  // dell'ultima transizione per il recupero dello stato
+  TransitionRecord oldest;
+  pending.pop(oldest);
+  pending.push(record);
+  droppedRecords++;
+  return false;
+}
+
+void StatePersistence::update() {
+  if (pending.empty()) return;
+  
+  if (pending.size() >= batchSize || esmMillis() - lastFlush >= flushInterval) {
+    flush();
+  }
+}
+
+bool StatePersistence::flush() {
+  lastFlush = esmMillis();
+  if (pending.empty()) return true;
+  if (fileSystem == nullptr) return false;
+  
+  char path[32];
+  TransitionRecord record;
+  bool ok = true;
+  
+  // Le copie nel ring non garantiscono il padding finale (StateId a 16 bit):
+  // il record viene scritto da un buffer azzerato fino al checksum compreso
+  uint8_t bytes[sizeof(TransitionRecord)];
+  memset(bytes, 0, sizeof(bytes));
+  const size_t usedBytes = offsetof(TransitionRecord, checksum) + sizeof(record.checksum);
+  
+  while (ok && !pending.empty()) {
+    // Segmento pieno: passa al successivo, che viene troncato e riscritto da zero.
+    // I segmenti non sono preallocati: il file cresce a ogni blocco scritto
+    const char* mode = "a";
+    if (recordsInSegment >= recordsPerSegment) {
+      currentSegment = (currentSegment + 1) % numSegments;
+      recordsInSegment = 0;
+      mode = "w";
+    }
+    
+    segmentPath(currentSegment, path, sizeof(path));
+    File file = fileSystem->open(path, mode);
+    if (!file) return false;
+    
+    // Un'unica apertura per tutti i record che entrano nel segmento
+    while (recordsInSegment < recordsPerSegment && pending.pop(record)) {
+      memcpy(bytes, &record, usedBytes);
+      if (file.write(bytes, sizeof(bytes)) != sizeof(bytes)) {
+        // Il record è già uscito dal ring: conta come perso
+        droppedRecords++;
+        ok = false;
+        break;
+      }
+      recordsInSegment++;
+    }
+    file.close();
+  }
+  
+  return ok;
+}
+
+bool StatePersistence::recoverLastRecord(TransitionRecord& record) const {
+  if (fileSystem == nullptr) return false;
+  
+  TransitionRecord candidate;
+  uint16_t count;
+  bool found = false;
+  for (uint8_t s = 0; s < numSegments; s++) {
+    if (readLastRecord(s, candidate, count) && (!found || candidate.sequence > record.sequence)) {
+      record = candidate;
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool StatePersistence::recoverLastState(StateId& lastState) const {
+  TransitionRecord record;
+  if (!recoverLastRecord(record)) return false;
+  lastState = record.toState;
+  return true;
+}
+
+void StatePersistence::forEachRecord(TransitionRecordVisitor visitor) const {
+  if (fileSystem == nullptr || visitor == nullptr) return;
+  
+  // Il segmento più vecchio è quello che segue il segmento corrente
+  char path[32];
+  TransitionRecord record;
+  for (uint8_t i = 1; i <= numSegments; i++) {
+    uint8_t segment = (currentSegment + i) % numSegments;
+    segmentPath(segment, path, sizeof(path));
+    
+    File file = fileSystem->open(path, "r");
+    if (!file) continue;
+    while (file.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) == sizeof(record)) {
+      if (record.sequence != 0 && record.checksum == computeChecksum(record)) {
+        visitor(record);
+      }
+    }
+    file.close();
+  }
+}
+
+bool StatePersistence::clear() {
+  pending.clear();
+  if (fileSystem == nullptr) return false;
+  
+  char path[32];
+  for (uint8_t s = 0; s < numSegments; s++) {
+    segmentPath(s, path, sizeof(path));
+    if (fileSystem->exists(path)) {
+      fileSystem->remove(path);
+    }
+  }
+  
+  currentSegment = 0;
+  recordsInSegment = 0;
+  return true;
+}
+
+#endif // ESM_HAS_FS
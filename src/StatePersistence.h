@@ -0,0 +1,97 @@
+/*
+  StatePersistence.h - Batched binary persistence of state transitions
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef STATE_PERSISTENCE_H
+#define STATE_PERSISTENCE_H
+
+#include "EsmPlatform.h"
+#include "EsmClock.h"
+#if ESM_HAS_FS
+#include <FS.h>
+#include "RingBuffer.h"
+
+// Record in RAM prima del flush (potenza di 2)
+#ifndef ESM_PERSISTENCE_BUFFER_SIZE
+#define ESM_PERSISTENCE_BUFFER_SIZE 16
+#endif
+
+// Record binario a dimensione fissa di una transizione
+struct TransitionRecord {
+  uint32_t sequence;           // Numero progressivo, crescente su tutti i segmenti
+  uint32_t timestamp;          // esmMillis() al momento della transizione
+  StateId fromState;           // Stato di partenza
+  StateId toState;             // Stato di arrivo
+  uint16_t checksum;           // Controllo di integrità (record scritto a metà)
+  // Padding finale con StateId a 16 bit: scritto sempre a zero
+};
+
+typedef void (*TransitionRecordVisitor)(const TransitionRecord& record);
+
+// Log delle transizioni su flash: i record vengono accumulati in un ring in RAM
+// e scritti a blocchi in una serie di segmenti a dimensione fissa usati a rotazione,
+// così le scritture si distribuiscono su tutti i file e lo spazio occupato è limitato.
+class StatePersistence {
+private:
+  fs::FS* fileSystem;
+  const char* basePath;
+  uint8_t numSegments;
+  uint16_t recordsPerSegment;
+  uint8_t batchSize;
+  unsigned long flushInterval;
+  
+  RingBuffer<TransitionRecord, ESM_PERSISTENCE_BUFFER_SIZE> pending;
+  uint32_t nextSequence;
+  uint8_t currentSegment;
+  uint16_t recordsInSegment;
+  uint64_t lastFlush;
+  uint32_t droppedRecords;
+  
+  static uint16_t computeChecksum(const TransitionRecord& record);
+  void segmentPath(uint8_t segment, char* path, size_t size) const;
+  bool readLastRecord(uint8_t segment, TransitionRecord& record, uint16_t& count) const;
+
+public:
+  StatePersistence();
+  
+  // Monta il log: basePath è il prefisso dei file dei segmenti (es. "/state_log"
+  // genera /state_log0.bin, /state_log1.bin, ...)
+  bool begin(fs::FS& fileSys, const char* basePath = "/state_log",
+             uint8_t segments = 4, uint16_t recordsPerSegment = 256);
+  
+  // Flush automatico quando ci sono batchSize record in coda o dopo intervalMs
+  void setFlushPolicy(uint8_t batchSize, unsigned long intervalMs);
+  
+  // Accoda una transizione in RAM: O(1), nessun accesso alla flash.
+  // Restituisce false se il ring era pieno e il flush è fallito: per far posto
+  // alla transizione è stato scartato il record più vecchio in coda
+  bool record(StateId fromState, StateId toState);
+  
+  // Da chiamare periodicamente (lo fa EventStateMachine::update()): esegue il flush se dovuto
+  void update();
+  
+  // Scrive subito su flash tutti i record in coda
+  bool flush();
+  
+  // Legge solo la coda del log: l'ultimo record valido di ogni segmento
+  bool recoverLastState(StateId& lastState) const;
+  bool recoverLastRecord(TransitionRecord& record) const;
+  
+  // Visita tutti i record salvati in ordine cronologico
+  void forEachRecord(TransitionRecordVisitor visitor) const;
+  
+  // Cancella tutti i segmenti e i record in coda
+  bool clear();
+  
+  // Record in attesa di flush
+  size_t getPendingRecords() const { return pending.size(); }
+  
+  // Record scartati perché il ring era pieno e la flash non scrivibile
+  uint32_t getDroppedRecords() const { return droppedRecords; }
+};
+
+#endif // ESM_HAS_FS
+
+#endif // STATE_PERSISTENCE_H
@@ -0,0 +1,246 @@
+/*
+  StateSnapshot.cpp - Binary/JSON snapshot of EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+#include "EventStateMachine.h"
+#include "StateSnapshot.h"
+
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+// Scrittura little-endian campo per campo: nessun buffer intermedio
+static size_t writeU8(Print& out, uint8_t value) {
+  return out.write(value);
+}
+
+static size_t writeU16(Print& out, uint16_t value) {
+  uint8_t bytes[2] = {(uint8_t)value, (uint8_t)(value >> 8)};
+  return out.write(bytes, sizeof(bytes));
+}
+
+static size_t writeU32(Print& out, uint32_t value) {
+  uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+  return out.write(bytes, sizeof(bytes));
+}
+
+static uint16_t snapshotState(StateId state) {
+  return state == ESM_NO_STATE ? ESM_SNAPSHOT_NO_STATE : state;
+}
+
+// Campo JSON numerico preceduto dalla virgola (tranne il primo)
+static size_t printJsonField(Print& out, const char* name, uint32_t value, bool first = false) {
+  size_t written = first ? 0 : out.print(',');
+  written += out.print('"');
+  written += out.print(name);
+  written += out.print("\":");
+  written += out.print((unsigned long)value);
+  return written;
+}
+
+bool EventStateMachine::inSnapshot(StateId state) const {
+  // Stati configurati, gli stati correnti delle regioni e quelli già visitati
+  if (states[state] != &emptyState || state == regions[regionOf(state)].current) return true;
+  return stateStatistics != nullptr && stateStatistics[state].entries > 0;
+}
+
+void EventStateMachine::countCallbacks(StateId state, uint8_t& enters, uint8_t& onStates, uint8_t& exits) const {
+  enters = 0;
+  onStates = 0;
+  exits = 0;
+  
+  if (!frozen) {
+    const StateDefinition& def = *states[state];
+    enters = def.onEnters.count();
+    onStates = def.onStates.count();
+    exits = def.onExits.count();
+    return;
+  }
+  
+  // Nella tabella congelata le posizioni libere hanno generazione 0
+  const FrozenSpan& span = states[state]->frozenSpan;
+  const FrozenCallback* entry = &frozenCallbacks[span.offset];
+  for (uint8_t i = 0; i < span.numEnters; i++) {
+    if (entry[i].generation != 0) enters++;
+  }
+  entry += span.numEnters;
+  for (uint8_t i = 0; i < span.numStates; i++) {
+    if (entry[i].generation != 0) onStates++;
+  }
+  entry += span.numStates;
+  for (uint8_t i = 0; i < span.numExits; i++) {
+    if (entry[i].generation != 0) exits++;
+  }
+}
+
+uint32_t EventStateMachine::snapshotTimeInState(StateId state) const {
+  uint32_t time = stateStatistics[state].timeInState;
+  const RegionState& region = regions[regionOf(state)];
+  if (state == region.current) {
+    time += esmTicksToMillis(esmClock() - region.statisticsVisitStart);
+  }
+  return time;
+}
+
+size_t EventStateMachine::writeSnapshot(Print& out) const {
+  bool statistics = stateStatistics != nullptr;
+  uint8_t flags = (frozen ? SNAPSHOT_FROZEN : 0) | (statistics ? SNAPSHOT_STATISTICS : 0);
+  
+  size_t written = out.write((const uint8_t*)"ESM", 3);
+  written += writeU8(out, ESM_SNAPSHOT_VERSION);
+  written += writeU16(out, numStates);
+  written += writeU16(out, currentState);
+  written += writeU8(out, flags);
+  written += writeU32(out, (uint32_t)esmMillis());
+  written += writeU32(out, getTransitionCount());
+  written += writeU32(out, rejectedTransitions);
+  written += writeU8(out, regionCount);
+  for (uint8_t r = 0; r < regionCount; r++) {
+    written += writeU16(out, regions[r].current);
+  }
+  
+  uint16_t records = 0;
+  for (StateId s = 0; s < numStates; s++) {
+    if (inSnapshot(s)) records++;
+  }
+  written += writeU16(out, records);
+  
+  for (StateId s = 0; s < numStates; s++) {
+    if (!inSnapshot(s)) continue;
+  
+    uint8_t enters, onStates, exits;
+    countCallbacks(s, enters, onStates, exits);
+  
+    // Solo i timeout attivi: le posizioni libere hanno il callback a nullptr
+    uint8_t timeouts = 0;
+    for (size_t i = 0; i < timeoutCount(s); i++) {
+      if (timeoutAt(s, i).callback != nullptr) timeouts++;
+    }
+  
+    written += writeU16(out, s);
+    written += writeU16(out, snapshotState(states[s]->parent));
+    written += writeU8(out, enters);
+    written += writeU8(out, onStates);
+    written += writeU8(out, exits);
+    written += writeU8(out, states[s]->transitions.size() < 255 ? states[s]->transitions.size() : 255);
+    written += writeU8(out, timeouts);
+    for (size_t i = 0; i < timeoutCount(s); i++) {
+      TimeoutInfo timeoutInfo = timeoutAt(s, i);
+      if (timeoutInfo.callback == nullptr) continue;
+      written += writeU32(out, timeoutInfo.duration);
+      written += writeU8(out, timeoutInfo.periodic ? 1 : 0);
+    }
+  
+    if (statistics) {
+      written += writeU32(out, stateStatistics[s].entries);
+      written += writeU32(out, snapshotTimeInState(s));
+      written += writeU32(out, stateStatistics[s].timeoutsFired);
+    }
+  }
+  
+  if (statistics) {
+    size_t cells = (size_t)numStates * numStates;
+    uint32_t pairs = 0;
+    for (size_t i = 0; i < cells; i++) {
+      if (transitionPairs[i] != 0) pairs++;
+    }
+    written += writeU32(out, pairs);
+    for (size_t i = 0; i < cells; i++) {
+      if (transitionPairs[i] == 0) continue;
+      written += writeU16(out, i / numStates);
+      written += writeU16(out, i % numStates);
+      written += writeU32(out, transitionPairs[i]);
+    }
+  }
+  
+  return written;
+}
+
+size_t EventStateMachine::printSnapshotJson(Print& out) const {
+  bool statistics = stateStatistics != nullptr;
+  
+  size_t written = out.print('{');
+  written += printJsonField(out, "version", ESM_SNAPSHOT_VERSION, true);
+  written += printJsonField(out, "numStates", numStates);
+  written += printJsonField(out, "currentState", currentState);
+  written += out.print(",\"frozen\":");
+  written += out.print(frozen ? "true" : "false");
+  written += printJsonField(out, "uptimeMs", (uint32_t)esmMillis());
+  written += printJsonField(out, "transitions", getTransitionCount());
+  written += printJsonField(out, "rejectedTransitions", rejectedTransitions);
+  written += out.print(",\"regions\":[");
+  for (uint8_t r = 0; r < regionCount; r++) {
+    if (r > 0) written += out.print(',');
+    written += out.print((unsigned int)regions[r].current);
+  }
+  written += out.print(']');
+  written += out.print(",\"states\":[");
+  
+  bool firstState = true;
+  for (StateId s = 0; s < numStates; s++) {
+    if (!inSnapshot(s)) continue;
+  
+    uint8_t enters, onStates, exits;
+    countCallbacks(s, enters, onStates, exits);
+  
+    written += out.print(firstState ? "{" : ",{");
+    firstState = false;
+    written += printJsonField(out, "state", s, true);
+    written += out.print(",\"parent\":");
+    if (states[s]->parent == ESM_NO_STATE) {
+      written += out.print("null");
+    } else {
+      written += out.print((unsigned int)states[s]->parent);
+    }
+    written += printJsonField(out, "onEnter", enters);
+    written += printJsonField(out, "onState", onStates);
+    written += printJsonField(out, "onExit", exits);
+    written += printJsonField(out, "eventTransitions", states[s]->transitions.size());
+  
+    written += out.print(",\"timeouts\":[");
+    bool firstTimeout = true;
+    for (size_t i = 0; i < timeoutCount(s); i++) {
+      TimeoutInfo timeoutInfo = timeoutAt(s, i);
+      if (timeoutInfo.callback == nullptr) continue;
+      written += out.print(firstTimeout ? "{" : ",{");
+      firstTimeout = false;
+      written += printJsonField(out, "ms", timeoutInfo.duration, true);
+      written += out.print(",\"periodic\":");
+      written += out.print(timeoutInfo.periodic ? "true" : "false");
+      written += out.print('}');
+    }
+    written += out.print(']');
+  
+    if (statistics) {
+      written += printJsonField(out, "entries", stateStatistics[s].entries);
+      written += printJsonField(out, "timeInStateMs", snapshotTimeInState(s));
+      written += printJsonField(out, "timeoutsFired", stateStatistics[s].timeoutsFired);
+    }
+    written += out.print('}');
+  }
+  written += out.print(']');
+  
+  // Coppie come [da, a, transizioni], solo quelle con contatore diverso da 0
+  if (statistics) {
+    written += out.print(",\"pairs\":[");
+    bool firstPair = true;
+    size_t cells = (size_t)numStates * numStates;
+    for (size_t i = 0; i < cells; i++) {
+      if (transitionPairs[i] == 0) continue;
+      written += out.print(firstPair ? "[" : ",[");
+      firstPair = false;
+      written += out.print((unsigned int)(i / numStates));
+      written += out.print(',');
+      written += out.print((unsigned int)(i % numStates));
+      written += out.print(',');
+      written += out.print((unsigned long)transitionPairs[i]);
+      written += out.print(']');
+    }
+    written += out.print(']');
+  }
+  
+  written += out.print('}');
+  return written;
+}
+  
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+  
\ No newline at end of file
@@ -0,0 +1,73 @@
+/*
+  StateSnapshot.h - Binary/JSON snapshot format of EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_SNAPSHOT_H
+#define EVENT_STATE_MACHINE_SNAPSHOT_H
+
+#include "EsmPlatform.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+// Formato binario di writeSnapshot(), little-endian, identificativi di stato
+// sempre a 16 bit (0xFFFF = nessuno) qualunque sia ESM_STATE_ID_TYPE:
+//
+//   intestazione  'E' 'S' 'M' versione(u8)
+//                 numStates(u16) currentState(u16) flags(u8)
+//                 uptimeMs(u32) transitionCount(u32) rejectedTransitions(u32)
+//                 regions(u8), poi regions x currentState(u16)
+//   stati         count(u16), poi per ciascuno stato configurato o visitato:
+//                 state(u16) parent(u16) onEnter(u8) onState(u8) onExit(u8)
+//                 eventTransitions(u8) timeouts(u8)
+//                 timeouts x [durationMs(u32) periodic(u8)]
+//                 con SNAPSHOT_STATISTICS: entries(u32) timeInStateMs(u32) timeoutsFired(u32)
+//   coppie        solo con SNAPSHOT_STATISTICS: count(u32), poi per ogni coppia
+//                 con contatore diverso da 0: from(u16) to(u16) transitions(u32)
+#define ESM_SNAPSHOT_VERSION 2
+#define ESM_SNAPSHOT_NO_STATE 0xFFFF
+
+// Bit del campo flags dell'intestazione
+enum SnapshotFlags : uint8_t {
+  SNAPSHOT_FROZEN = 0x01,      // Macchina congelata con freeze()
+  SNAPSHOT_STATISTICS = 0x02   // Contatori di esercizio presenti (enableStatistics())
+};
+
+// Print su un buffer fornito dal chiamante, ad esempio per il payload di un
+// messaggio MQTT. I byte oltre la capacità vengono scartati e contati
+class EsmBufferPrint : public Print {
+public:
+  EsmBufferPrint(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity), length(0), overflow(0) {}
+  
+  size_t write(uint8_t c) override {
+    if (length >= capacity) {
+      overflow++;
+      return 0;
+    }
+    buffer[length++] = c;
+    return 1;
+  }
+  
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t written = 0;
+    while (size--) {
+      written += write(*data++);
+    }
+    return written;
+  }
+  using Print::write;
+  
+  size_t size() const { return length; }
+  size_t getOverflow() const { return overflow; }     // Byte scartati, 0 se tutto è entrato
+  void clear() { length = 0; overflow = 0; }
+  
+private:
+  uint8_t* buffer;
+  size_t capacity;
+  size_t length;
+  size_t overflow;
+};
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // EVENT_STATE_MACHINE_SNAPSHOT_H
@@ -0,0 +1,91 @@
+/*
+  StateTask.h - Resumable state bodies (protothread style) for EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef STATE_TASK_H
+#define STATE_TASK_H
+
+#include "EsmPlatform.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+#include "EsmDelegate.h"
+
+class StateTask;
+class EventStateMachine;
+
+// Corpo di uno stato (setStateTask()): una funzione riprendibile senza stack propria
+typedef EsmDelegate<void(StateTask& task)> StateTaskDelegate;
+
+// Stato di esecuzione di un corpo
+enum StateTaskStatus : uint8_t {
+  TASK_IDLE = 0,               // Stato non attivo o corpo terminato
+  TASK_READY,                  // Da riprendere al prossimo update()
+  TASK_WAIT_DELAY,             // In attesa di una scadenza
+  TASK_WAIT_EVENT              // In attesa di un evento, con scadenza opzionale
+};
+
+// Contesto di un corpo di stato. La macchina lo riprende dal punto di attesa solo
+// quando la scadenza o l'evento atteso arrivano, e lo annulla all'uscita dallo
+// stato. Le variabili locali non sopravvivono a un'attesa: i dati da conservare
+// vanno tenuti fuori dal corpo (membri di un oggetto, variabili statiche)
+class StateTask {
+public:
+  explicit StateTask(StateId state) : state(state) {}
+  
+  StateId getState() const { return state; }
+  StateTaskStatus getStatus() const { return (StateTaskStatus)status; }
+  
+  // Payload dell'evento che ha ripreso il corpo (ESM_TASK_AWAIT_EVENT)
+  uint32_t getPayload() const { return payload; }
+  
+  // true se l'ultima ESM_TASK_AWAIT_EVENT è terminata per scadenza
+  bool timedOut() const { return expired; }
+  
+  // Usati dalle macro ESM_TASK_*
+  void delay(unsigned long ms) { status = TASK_WAIT_DELAY; duration = ms; }
+  void awaitEvent(uint8_t eventId, unsigned long timeoutMs) { status = TASK_WAIT_EVENT; awaitedEvent = eventId; duration = timeoutMs; }
+  void yield() { status = TASK_READY; }
+  void finish() { status = TASK_IDLE; resumePoint = 0; }
+  
+  uint16_t resumePoint = 0;    // Riga dell'ultimo punto di attesa, 0 = inizio
+  
+private:
+  friend class EventStateMachine;
+  
+  StateTaskDelegate body;
+  unsigned long duration = 0;  // Attesa richiesta in millisecondi (0 = evento senza scadenza)
+  uint32_t payload = 0;
+  StateId state;
+  uint8_t status = TASK_IDLE;
+  uint8_t awaitedEvent = 0;
+  bool expired = false;
+  bool running = false;        // Corpo in esecuzione: uscita e rientro vengono applicati al ritorno
+  bool cancelled = false;
+  bool restarted = false;
+};
+
+// Macro del corpo, sul modello dei protothread: ESM_TASK_BEGIN e ESM_TASK_END
+// racchiudono il corpo, ogni attesa salva la riga e ritorna. Al massimo un'attesa
+// per riga e nessuno switch che contenga un'attesa
+#define ESM_TASK_BEGIN(task) switch ((task).resumePoint) { case 0:
+#define ESM_TASK_END(task) } (task).finish(); return
+
+#define ESM_TASK_SUSPEND(task) (task).resumePoint = __LINE__; return; case __LINE__:;
+
+// Riprende il corpo dopo 'ms' millisecondi
+#define ESM_TASK_DELAY(task, ms) do { (task).delay(ms); ESM_TASK_SUSPEND(task) } while (0)
+
+// Riprende il corpo quando arriva l'evento 'eventId' (postEvent()) oppure dopo
+// 'timeoutMs' millisecondi, 0 = senza scadenza; poi task.timedOut() e task.getPayload()
+#define ESM_TASK_AWAIT_EVENT(task, eventId, timeoutMs) do { (task).awaitEvent(eventId, timeoutMs); ESM_TASK_SUSPEND(task) } while (0)
+
+// Riprende il corpo al prossimo update()
+#define ESM_TASK_YIELD(task) do { (task).yield(); ESM_TASK_SUSPEND(task) } while (0)
+
+// Termina il corpo prima della fine
+#define ESM_TASK_EXIT(task) do { (task).finish(); return; } while (0)
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // STATE_TASK_H
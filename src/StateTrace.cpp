@@ -0,0 +1,81 @@
+/*
+  StateTrace.cpp - Binary trace events for EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+#include "StateTrace.h"
+
+void printTraceEvent(Print& out, const TraceEvent& event) {
+  out.print("DEBUG: [");
+  out.print(event.timestamp);
+  out.print("us] ");
+  
+  switch (event.type) {
+    case TRACE_STATE_CHANGE:
+      out.print("State change ");
+      out.print(event.state);
+      out.print(" -> ");
+      out.println(event.value);
+      break;
+    case TRACE_EVENT_DROPPED:
+      out.print("Event queue full, dropped event ");
+      out.println(event.index);
+      break;
+    case TRACE_TIMEOUT_SET:
+      out.print("Timeout set for state ");
+      out.print(event.state);
+      out.print(", index ");
+      out.print(event.index);
+      out.print(", duration ");
+      out.print(event.value);
+      out.println(" ms");
+      break;
+    case TRACE_TIMEOUT_FIRED:
+      out.print("Timeout triggered for state ");
+      out.print(event.state);
+      out.print(", index ");
+      out.println(event.index);
+      break;
+    case TRACE_EVENT_POSTED:
+      out.print("Event ");
+      out.print(event.index);
+      out.print(" posted in state ");
+      out.print(event.state);
+      out.print(", payload ");
+      out.println(event.value);
+      break;
+    case TRACE_EVENT_DISPATCHED:
+      out.print("Event ");
+      out.print(event.index);
+      out.print(" dispatched in state ");
+      out.print(event.state);
+      out.print(", payload ");
+      out.println(event.value);
+      break;
+    case TRACE_TRANSITION_REJECTED:
+      out.print("Transition not allowed ");
+      out.print(event.state);
+      out.print(" -> ");
+      out.println(event.value);
+      break;
+    case TRACE_STATE_REQUEST_DROPPED:
+      out.print("Pending setState(");
+      out.print(event.state);
+      out.print(") replaced by setState(");
+      out.print(event.value);
+      out.println(")");
+      break;
+    case TRACE_TIMEOUT_DROPPED:
+      out.print("Stale timeout dropped for state ");
+      out.print(event.state);
+      out.print(", index ");
+      out.print(event.index);
+      out.print(", generation ");
+      out.println(event.value);
+      break;
+    default:
+      out.print("Unknown trace event ");
+      out.println(event.type);
+      break;
+  }
+}
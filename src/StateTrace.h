@@ -0,0 +1,58 @@
+/*
+  StateTrace.h - Binary trace events for EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef STATE_TRACE_H
+#define STATE_TRACE_H
+
+#include "EsmPlatform.h"
+
+// Livello di trace: 0 = disattivato (nessun codice generato), 1 = transizioni
+// ed errori, 2 = anche timeout ed eventi
+#ifndef ESM_TRACE_LEVEL
+#define ESM_TRACE_LEVEL 2
+#endif
+
+// Dimensione del ring dei TraceEvent (potenza di 2)
+#ifndef ESM_TRACE_BUFFER_SIZE
+#define ESM_TRACE_BUFFER_SIZE 32
+#endif
+
+// Numero massimo di TraceEvent formattati per ogni update()
+#ifndef ESM_TRACE_PRINT_PER_UPDATE
+#define ESM_TRACE_PRINT_PER_UPDATE 4
+#endif
+
+// Tipi di evento di trace
+enum TraceEventType : uint8_t {
+  TRACE_STATE_CHANGE = 0,      // state = da, value = a
+  TRACE_EVENT_DROPPED,         // index = evento, coda piena
+  TRACE_TIMEOUT_SET,           // state, index = timeout, value = durata
+  TRACE_TIMEOUT_FIRED,         // state, index = timeout
+  TRACE_EVENT_POSTED,          // state = stato corrente, index = evento, value = payload
+  TRACE_EVENT_DISPATCHED,      // state = stato corrente, index = evento, value = payload
+  TRACE_TIMEOUT_DROPPED,       // state, index = timeout, value = generazione della visita scaduta
+  TRACE_TRANSITION_REJECTED,   // state = da, value = a, transizione non ammessa
+  TRACE_STATE_REQUEST_DROPPED  // state = richiesta sostituita, value = nuova richiesta
+};
+
+// Record binario compatto, formattato più tardi fuori dal percorso critico
+struct TraceEvent {
+  uint32_t timestamp;          // micros() al momento dell'evento
+  uint8_t type;                // TraceEventType
+  StateId state;               // Stato interessato
+  uint8_t index;               // Indice del timeout o identificativo dell'evento
+  uint32_t value;              // Durata, payload o stato di destinazione
+};
+
+// Livello richiesto da ciascun tipo di evento
+inline uint8_t traceEventLevel(uint8_t type) {
+  return type <= TRACE_EVENT_DROPPED || type >= TRACE_TRANSITION_REJECTED ? 1 : 2;
+}
+
+// Scrive un TraceEvent in forma leggibile (una riga)
+void printTraceEvent(Print& out, const TraceEvent& event);
+
+#endif // STATE_TRACE_H
@@ -0,0 +1,182 @@
+/*
+  StaticEventStateMachine.h - Compile-time configured variant of EventStateMachine
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef STATIC_EVENT_STATE_MACHINE_H
+#define STATIC_EVENT_STATE_MACHINE_H
+
+#include "EventStateMachine.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+#include <array>
+
+// Timeout di uno stato definito a tempo di compilazione
+struct StaticTimeout {
+  unsigned long duration;      // Durata in millisecondi
+  StateCallback callback;      // Funzione callback
+};
+
+// Definizione constexpr di uno stato: fino a MaxCallbacks callback per tipo
+// e MaxTimeouts timeout. Le posizioni non usate restano a nullptr.
+template <size_t MaxCallbacks, size_t MaxTimeouts>
+struct StaticStateDefinition {
+  std::array<StateCallback, MaxCallbacks> onEnters;   // Callback all'entrata dello stato
+  std::array<StateFunction, MaxCallbacks> onStates;   // Callback durante lo stato
+  std::array<StateCallback, MaxCallbacks> onExits;    // Callback all'uscita dello stato
+  std::array<StaticTimeout, MaxTimeouts> timeouts;    // Informazioni sui timeout
+};
+
+// Macchina a stati con tabella dei callback fissata a tempo di compilazione.
+// La tabella è const (.rodata) e lo stato runtime ha dimensione fissa: nessuna
+// allocazione sull'heap, né in configurazione né durante l'esecuzione.
+template <StateId NumStates, size_t MaxCallbacks = 1, size_t MaxTimeouts = 1>
+class StaticEventStateMachine {
+  static_assert(NumStates > 0, "StaticEventStateMachine needs at least one state");
+  static_assert(MaxTimeouts < 256, "Timeout indexes are stored in 8 bits");
+
+public:
+  typedef StaticStateDefinition<MaxCallbacks, MaxTimeouts> Definition;
+
+private:
+  const Definition (&states)[NumStates];
+  StateId currentState;
+  StateId previousState;
+  bool stateChanged;
+  EsmTime stateEnteredTime;
+  
+  // Handler globali per transizioni di stato
+  GlobalStateCallback beforeStateChangeHandler;
+  GlobalStateCallback afterStateChangeHandler;
+  
+  // Scheduler dei timeout: un solo Ticker e un min-heap a dimensione fissa
+  Ticker timeoutTicker;
+  std::array<TimeoutEntry, MaxTimeouts> pendingTimeouts;
+  uint8_t numPendingTimeouts;
+  
+  bool isValidState(StateId state) const { return state < NumStates; }
+  
+  static void onTimeoutStatic(StaticEventStateMachine* machine) {
+    machine->processTimeouts();
+  }
+  
+  void armTimeoutTicker() {
+    if (numPendingTimeouts == 0) {
+      timeoutTicker.detach();
+      return;
+    }
+    
+    EsmTime now = esmClock();
+    EsmTime deadline = pendingTimeouts[0].deadline;
+    timeoutTicker.once_ms(deadline > now ? esmTicksToWait(deadline - now) : 0, onTimeoutStatic, this);
+  }
+  
+  void scheduleTimeouts() {
+    const auto& timeouts = states[currentState].timeouts;
+    EsmTime now = stateEnteredTime;
+    
+    numPendingTimeouts = 0;
+    for (size_t i = 0; i < MaxTimeouts && timeouts[i].callback != nullptr; i++) {
+      // Nessuna gerarchia né coda differita: lo stato è sempre quello corrente e la
+      // generazione non serve, perché setState() svuota l'heap prima di cambiare stato
+      pendingTimeouts[numPendingTimeouts++] = {now + esmMillisToTicks(timeouts[i].duration), (uint8_t)i,
+                                               currentState, 0};
+      std::push_heap(pendingTimeouts.begin(), pendingTimeouts.begin() + numPendingTimeouts, timeoutExpiresLater);
+    }
+    
+    armTimeoutTicker();
+  }
+  
+  void processTimeouts() {
+    StateId state = currentState;
+    
+    // Esegue tutte le scadenze raggiunte; un setState() nel callback riempie di nuovo la coda
+    while (numPendingTimeouts > 0 && currentState == state) {
+      if (esmClock() < pendingTimeouts[0].deadline) break;
+      
+      uint8_t index = pendingTimeouts[0].index;
+      std::pop_heap(pendingTimeouts.begin(), pendingTimeouts.begin() + numPendingTimeouts, timeoutExpiresLater);
+      numPendingTimeouts--;
+      
+      states[state].timeouts[index].callback(currentState, previousState);
+    }
+    
+    armTimeoutTicker();
+  }
+
+public:
+  explicit StaticEventStateMachine(const Definition (&table)[NumStates],
+                                   GlobalStateCallback beforeStateChange = nullptr,
+                                   GlobalStateCallback afterStateChange = nullptr)
+    : states(table), currentState(0), previousState(0), stateChanged(true),
+      stateEnteredTime(esmClock()), beforeStateChangeHandler(beforeStateChange),
+      afterStateChangeHandler(afterStateChange), numPendingTimeouts(0) {}
+  
+  ~StaticEventStateMachine() {
+    timeoutTicker.detach();
+  }
+  
+  // Cambia lo stato
+  void setState(StateId newState) {
+    if (!isValidState(newState)) return;
+    
+    // Non fare nulla se lo stato non cambia
+    if (newState == currentState) return;
+    
+    if (beforeStateChangeHandler != nullptr) {
+      beforeStateChangeHandler(currentState, newState);
+    }
+    
+    // Annulla le scadenze dello stato corrente
+    numPendingTimeouts = 0;
+    timeoutTicker.detach();
+    
+    for (StateCallback onExit : states[currentState].onExits) {
+      if (onExit == nullptr) break;
+      onExit(currentState, newState);
+    }
+    
+    previousState = currentState;
+    currentState = newState;
+    stateEnteredTime = esmClock();
+    stateChanged = true;
+    
+    for (StateCallback onEnter : states[currentState].onEnters) {
+      if (onEnter == nullptr) break;
+      onEnter(currentState, previousState);
+    }
+    
+    scheduleTimeouts();
+    
+    if (afterStateChangeHandler != nullptr) {
+      afterStateChangeHandler(previousState, currentState);
+    }
+  }
+  
+  // Esecuzione di un ciclo della macchina a stati
+  void update() {
+    for (StateFunction onState : states[currentState].onStates) {
+      if (onState == nullptr) break;
+      onState(currentState);
+    }
+    
+    stateChanged = false;
+  }
+  
+  // Getter per lo stato corrente
+  StateId getCurrentState() const { return currentState; }
+  
+  // Getter per lo stato precedente
+  StateId getPreviousState() const { return previousState; }
+  
+  // Controlla se lo stato è appena cambiato
+  bool isStateChanged() const { return stateChanged; }
+  
+  // Tempo trascorso nello stato corrente
+  unsigned long timeInCurrentState() const { return esmTicksToMillis(esmClock() - stateEnteredTime); }
+  uint64_t timeInCurrentStateMicros() const { return esmTicksToMicros(esmClock() - stateEnteredTime); }
+};
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // STATIC_EVENT_STATE_MACHINE_H
@@ -0,0 +1,112 @@
+/*
+  TransitionMatrix.h - Compile-time table of the allowed state transitions
+  Part of the EventStateMachine library for Arduino ESP8266/ESP32
+  Released under MIT License.
+*/
+
+#ifndef EVENT_STATE_MACHINE_TRANSITION_MATRIX_H
+#define EVENT_STATE_MACHINE_TRANSITION_MATRIX_H
+
+#include "EventStateMachine.h"
+#if defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+// Transizione ammessa da uno stato a un altro; ESM_NO_STATE vale come "qualsiasi
+// stato", ad esempio {ESM_NO_STATE, STATE_ERROR} ammette l'errore da ogni stato
+struct AllowedTransition {
+  StateId from;
+  StateId to;
+};
+
+// Bitset denso NumStates x NumStates: il bit (da * NumStates + a) indica una
+// transizione ammessa. Costruito a tempo di compilazione da makeTransitionMatrix(),
+// occupa NumStates * NumStates / 8 byte di sola lettura
+template <StateId NumStates>
+struct TransitionMatrix {
+  static_assert(NumStates > 0 && NumStates < ESM_NO_STATE, "TransitionMatrix needs 1 to ESM_NO_STATE - 1 states");
+  
+  static constexpr size_t BYTES = ((size_t)NumStates * NumStates + 7) / 8;
+  uint8_t bits[BYTES];
+  
+  constexpr bool allows(StateId from, StateId to) const {
+    return from < NumStates && to < NumStates &&
+           (bits[((size_t)from * NumStates + to) >> 3] & (1 << (((size_t)from * NumStates + to) & 7))) != 0;
+  }
+  
+  constexpr void allow(StateId from, StateId to) {
+    bits[((size_t)from * NumStates + to) >> 3] |= (uint8_t)(1 << (((size_t)from * NumStates + to) & 7));
+  }
+};
+
+// Non constexpr: chiamata durante la valutazione a tempo di compilazione, trasforma
+// un AllowedTransition con uno stato fuori intervallo in un errore di compilazione
+inline void transitionMatrixStateOutOfRange() {}
+
+// Costruisce la matrice dalle coppie ammesse. Con un risultato constexpr gli stati
+// non validi vengono segnalati dal compilatore
+template <StateId NumStates, size_t Count>
+constexpr TransitionMatrix<NumStates> makeTransitionMatrix(const AllowedTransition (&allowed)[Count]) {
+  TransitionMatrix<NumStates> matrix = {};
+  for (size_t i = 0; i < Count; i++) {
+    StateId from = allowed[i].from;
+    StateId to = allowed[i].to;
+    if ((from >= NumStates && from != ESM_NO_STATE) || (to >= NumStates && to != ESM_NO_STATE)) {
+      transitionMatrixStateOutOfRange();
+      continue;
+    }
+  
+    // Con ESM_NO_STATE l'intervallo copre tutti gli stati, altrimenti uno solo
+    size_t fromEnd = from == ESM_NO_STATE ? NumStates : (size_t)from + 1;
+    size_t toEnd = to == ESM_NO_STATE ? NumStates : (size_t)to + 1;
+    for (size_t f = from == ESM_NO_STATE ? 0 : from; f < fromEnd; f++) {
+      for (size_t t = to == ESM_NO_STATE ? 0 : to; t < toEnd; t++) {
+        matrix.allow((StateId)f, (StateId)t);
+      }
+    }
+  }
+  return matrix;
+}
+
+// Verifica a tempo di compilazione di una tabella di loadTransitions():
+// static_assert(transitionsAllowed(matrix, table), "...")
+// Controlla solo il bit esatto (da, a). A runtime isTransitionAllowed() ammette
+// anche le transizioni concesse a un antenato: con stati gerarchici va usata la
+// versione con la tabella dei padri, altrimenti questa può rifiutare righe valide
+template <StateId NumStates, size_t Count>
+constexpr bool transitionsAllowed(const TransitionMatrix<NumStates>& matrix, const TransitionConfig (&table)[Count]) {
+  for (size_t i = 0; i < Count; i++) {
+    if (!matrix.allows(table[i].state, table[i].targetState)) return false;
+  }
+  return true;
+}
+
+// Come isTransitionAllowed(): ammessa dallo stato o da uno dei suoi antenati.
+// parents[s] è il padre di s (ESM_NO_STATE per le radici), come con setParent();
+// al più NumStates passi, così un ciclo nella tabella non blocca il compilatore
+template <StateId NumStates>
+constexpr bool allowsFromChain(const TransitionMatrix<NumStates>& matrix, const StateId (&parents)[NumStates],
+                               StateId from, StateId to) {
+  for (size_t depth = 0; depth < NumStates && from < NumStates; depth++) {
+    if (matrix.allows(from, to)) return true;
+    from = parents[from];
+  }
+  return false;
+}
+
+// static_assert(transitionsAllowed(matrix, parents, table), "...")
+template <StateId NumStates, size_t Count>
+constexpr bool transitionsAllowed(const TransitionMatrix<NumStates>& matrix, const StateId (&parents)[NumStates],
+                                  const TransitionConfig (&table)[Count]) {
+  for (size_t i = 0; i < Count; i++) {
+    if (!allowsFromChain(matrix, parents, table[i].state, table[i].targetState)) return false;
+  }
+  return true;
+}
+
+template <StateId NumStates>
+bool EventStateMachine::setAllowedTransitions(const TransitionMatrix<NumStates>& matrix) {
+  return setAllowedTransitions(matrix.bits, NumStates);
+}
+
+#endif // defined(ESP8266) || defined(ESP32) || defined(ESM_HOST)
+
+#endif // EVENT_STATE_MACHINE_TRANSITION_MATRIX_H